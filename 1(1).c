@@ -1,112 +1,2160 @@
 #include <linux/module.h>
 #include <linux/genhd.h>
-#include <linux/vmalloc.h>
 #include <linux/fs.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/rwsem.h>
+#include <linux/lockdep.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/prandom.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/crypto.h>
+#include <linux/zsmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/sched/mm.h>
+#include <linux/bitmap.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/string.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/capability.h>
+
+#define PAGE_SECTORS_SHIFT (PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
+#define SBD_HIST_BUCKETS 48
+#define SBD_STRIPE_SHIFT (16 - SECTOR_SHIFT)
+// Most pages written back to the backing file in one write.
+#define SBD_WB_BATCH 256
+// Interleaved placement moves to the next node every 2 MiB of the device.
+#define SBD_NUMA_CHUNK_SHIFT (21 - PAGE_SHIFT)
+// Pages that do not compress below this size are stored as they are.
+#define SBD_HUGE_SIZE (PAGE_SIZE / 4 * 3)
+
+// Snapshot ioctls. SBD_IOC_SNAPSHOT takes a nonzero argument for a
+// writable clone and returns the new device's minor. SBD_IOC_DELETE takes
+// the minor of a snapshot device, which must not be open.
+#define SBD_IOC_MAGIC 0x5b
+#define SBD_IOC_SNAPSHOT _IO(SBD_IOC_MAGIC, 1)
+#define SBD_IOC_DELETE _IO(SBD_IOC_MAGIC, 2)
 
-#define DEVICE_SIZE (4 * 1024 * 1024) 
+#define SBD_STRESS_WINDOWS 4
+#define SBD_STRESS_WINDOW_STRIDE (256 * 1024)
+#define SBD_STRESS_WINDOW_OFFSET (60 * 1024)
+#define SBD_STRESS_WINDOW_SIZE (72 * 1024)
 
-static int sector_size = 512;
 static int major = 0;
 
-static struct sbd_struct {
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of sbd instances to create (default: 1)");
+
+static char name[DISK_NAME_LEN - 8] = "sbd";
+module_param_string(name, name, sizeof(name), 0444);
+MODULE_PARM_DESC(name, "Disk name prefix, suffixed with the index when nr_devices > 1 (default: sbd)");
+
+static unsigned long size_mb = 4;
+module_param(size_mb, ulong, 0444);
+MODULE_PARM_DESC(size_mb, "Size of each instance in MiB (default: 4)");
+
+static unsigned int logical_block_size = SECTOR_SIZE;
+module_param(logical_block_size, uint, 0444);
+MODULE_PARM_DESC(logical_block_size, "Logical block size in bytes, 512 to PAGE_SIZE (default: 512)");
+
+static unsigned int physical_block_size = 0;
+module_param(physical_block_size, uint, 0444);
+MODULE_PARM_DESC(physical_block_size, "Physical block size in bytes, 0 for the logical block size (default: 0)");
+
+static unsigned int max_hw_sectors = 0;
+module_param(max_hw_sectors, uint, 0444);
+MODULE_PARM_DESC(max_hw_sectors, "Largest request in 512 byte sectors, 0 for the block layer default (default: 0)");
+
+static unsigned int max_segments = 0;
+module_param(max_segments, uint, 0444);
+MODULE_PARM_DESC(max_segments, "Most segments per request, 0 for the block layer default (default: 0)");
+
+static unsigned int io_min = 0;
+module_param(io_min, uint, 0444);
+MODULE_PARM_DESC(io_min, "Minimum preferred I/O size in bytes, 0 to leave unset (default: 0)");
+
+static unsigned int io_opt = 0;
+module_param(io_opt, uint, 0444);
+MODULE_PARM_DESC(io_opt, "Optimal I/O size in bytes, 0 to leave unset (default: 0)");
+
+static bool rotational = false;
+module_param(rotational, bool, 0444);
+MODULE_PARM_DESC(rotational, "Report the device as rotational (default: false)");
+
+static unsigned int hw_queues = 0;
+module_param(hw_queues, uint, 0444);
+MODULE_PARM_DESC(hw_queues, "Number of hardware queues, 0 for one per CPU (default: 0)");
+
+static unsigned int poll_queues = 0;
+module_param(poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "Number of extra hardware queues for polled I/O (default: 0)");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of tags per hardware queue (default: 128)");
+
+static unsigned int lock_stripes = 256;
+module_param(lock_stripes, uint, 0444);
+MODULE_PARM_DESC(lock_stripes, "Number of range lock stripes over 64 KiB regions, a power of two (default: 256)");
+
+static char compress[CRYPTO_MAX_ALG_NAME];
+module_param_string(compress, compress, sizeof(compress), 0444);
+MODULE_PARM_DESC(compress, "Compress backing pages with this crypto algorithm, e.g. lz4 or zstd (default: off)");
+
+static char backing_file[PATH_MAX / 16];
+module_param_string(backing_file, backing_file, sizeof(backing_file), 0444);
+MODULE_PARM_DESC(backing_file, "Persist contents to this file, suffixed with the index when nr_devices > 1 (default: off)");
+
+static unsigned int writeback_ms = 1000;
+module_param(writeback_ms, uint, 0444);
+MODULE_PARM_DESC(writeback_ms, "Interval between background writebacks in milliseconds (default: 1000)");
+
+static char numa_policy[16] = "local";
+module_param_string(numa_policy, numa_policy, sizeof(numa_policy), 0444);
+MODULE_PARM_DESC(numa_policy, "Backing page placement: local, interleave or bind (default: local)");
+
+static int numa_node = 0;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "Node backing pages are bound to with numa_policy=bind (default: 0)");
+
+static unsigned int stress_seconds = 0;
+module_param(stress_seconds, uint, 0444);
+MODULE_PARM_DESC(stress_seconds, "Run the torn write check for this many seconds per device at load (default: 0)");
+
+// Histogram bucket b counts values in [2^(b - 1), 2^b), bucket 0 counts zero.
+struct sbd_stats {
+    u64 ios[2];
+    u64 bytes[2];
+    u64 discards;
+    u64 segments[SBD_HIST_BUCKETS];
+    u64 sizes[SBD_HIST_BUCKETS];
+    u64 latency[2][SBD_HIST_BUCKETS];
+    u64 compressions;
+    u64 compress_ns;
+    u64 decompressions;
+    u64 decompress_ns;
+    // Page copies whose backing page was on this CPU's node, or elsewhere.
+    u64 numa_hits;
+    u64 numa_misses;
+};
+
+enum sbd_numa_policy {
+    SBD_NUMA_LOCAL,
+    SBD_NUMA_INTERLEAVE,
+    SBD_NUMA_BIND,
+};
+
+static const char * const sbd_numa_policies[] = {
+    [SBD_NUMA_LOCAL] = "local",
+    [SBD_NUMA_INTERLEAVE] = "interleave",
+    [SBD_NUMA_BIND] = "bind",
+};
+
+// A compressed backing page. Same-filled pages keep only their fill word
+// and no pool object; all-zero pages are not stored at all.
+struct sbd_zentry {
+    unsigned long handle; // zsmalloc handle, or the fill word if size is 0
+    unsigned int size;    // Compressed size, PAGE_SIZE if stored as is
+};
+
+// Per-CPU compression context; the buffers are only used with preemption off.
+struct sbd_zstream {
+    struct crypto_comp *tfm;
+    void *buffer;  // Compression output, two pages in case data expands
+    void *scratch; // Decompression output for partial page reads
+};
+
+// Per request state, kept in the blk-mq PDU.
+struct sbd_cmd {
+    blk_status_t status;
+    u64 start;
+};
+
+// Requests on a poll queue are served at submission but only completed
+// when the submitter polls, so completion runs in its context.
+struct sbd_poll_queue {
+    spinlock_t lock;
+    struct list_head done;
+} ____cacheline_aligned_in_smp;
+
+// Each 64 KiB region of the device maps to one stripe, so requests to
+// different regions mostly take different locks.
+struct sbd_stripe {
+    struct rw_semaphore lock;
+} ____cacheline_aligned_in_smp;
+
+// One level of a device's page map. A device writes only to its top
+// layer; a snapshot freezes the top layer and puts a new empty one over it
+// in both the origin and the snapshot, so lookups fall through to the
+// shared frozen layers. Frozen layers are never modified and are freed
+// with their last reference.
+struct sbd_layer {
+    // Backing pages keyed by page index, allocated on first write. In
+    // compressed mode the entries are struct sbd_zentry instead. Above a
+    // frozen layer, SBD_TOMBSTONE marks a discarded page hiding the one
+    // below.
+    struct xarray pages;
+    unsigned long nr_pages;
+    struct sbd_layer *parent;
+    struct kref ref;
+};
+
+#define SBD_TOMBSTONE xa_mk_value(0)
+
+struct sbd_struct {
     struct gendisk *gd;
-    void *memory;
-} sbd_dev;
+    struct blk_mq_tag_set tag_set;
+    struct sbd_layer *top;
+    bool read_only;
+    struct list_head list; // On sbd_snapshots for snapshot devices
+    unsigned int openers;  // Under sbd_open_lock, like deleting
+    bool deleting;
+    struct zs_pool *zpool;
+    atomic64_t compr_bytes;
+    atomic64_t same_pages;
+    atomic64_t huge_pages;
+    struct sbd_stripe *stripes;
+    struct lockdep_map range_map; // Stands in for the stripes under lockdep
+    struct sbd_poll_queue *poll;
+    // Backing file state. A page is loaded once its file contents have been
+    // faulted in (or overwritten), and dirty until written back.
+    struct file *file;
+    unsigned long store_pages;
+    unsigned long *loaded;
+    unsigned long *dirty;
+    struct bio_vec *wb_bvec;
+    struct mutex wb_mutex;
+    struct delayed_work wb_work;
+    atomic64_t faults;
+    atomic64_t written_back;
+    struct sbd_stats __percpu *stats;
+    struct dentry *debugfs;
+};
 
-static inline int transfer_single_bio(struct bio *bio) {
-    struct bvec_iter iter;
-    struct bio_vec vector;
-    sector_t sector = bio->bi_iter.bi_sector;
-    bool write = bio_data_dir(bio) == WRITE;
+static struct sbd_struct *sbd_devs;
+// Snapshot devices, which take minors after the nr_devices origins.
+static LIST_HEAD(sbd_snapshots);
+static DEFINE_MUTEX(sbd_snapshot_mutex);
+static DEFINE_SPINLOCK(sbd_open_lock);
+static DEFINE_IDA(sbd_minors);
+static struct dentry *sbd_debugfs;
+static struct kmem_cache *sbd_zentry_cache;
+static struct sbd_zstream __percpu *sbd_zstreams;
 
-    bio_for_each_segment(vector, bio, iter) {
-        unsigned int len = vector.bv_len;
-        void *addr = kmap(vector.bv_page);
-        if (write)
-            memcpy((void *)(sbd_dev.memory + sector * sector_size), (void *)(addr + vector.bv_offset), len);
+// Statistics are off by default and cost a patched-out branch until enabled.
+static DEFINE_STATIC_KEY_FALSE(sbd_stats_enabled);
+
+// The first layer with an entry for the page decides; a tombstone or no
+// entry at all reads as a hole.
+static inline struct page *sbd_lookup_page(struct sbd_struct *dev, sector_t sector) {
+    pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+    struct sbd_layer *layer;
+    void *entry;
+
+    for (layer = dev->top; layer; layer = layer->parent) {
+        entry = xa_load(&layer->pages, index);
+        if (entry)
+            return xa_is_value(entry) ? NULL : entry;
+    }
+    return NULL;
+}
+
+static struct sbd_layer *sbd_alloc_layer(struct sbd_layer *parent) {
+    struct sbd_layer *layer = kzalloc(sizeof(*layer), GFP_KERNEL);
+
+    if (!layer)
+        return NULL;
+    xa_init(&layer->pages);
+    kref_init(&layer->ref);
+    if (parent)
+        kref_get(&parent->ref);
+    layer->parent = parent;
+    return layer;
+}
+
+// Only frozen layers are released this way, and those hold plain pages.
+static void sbd_release_layer(struct kref *ref) {
+    struct sbd_layer *layer = container_of(ref, struct sbd_layer, ref);
+    struct sbd_layer *parent = layer->parent;
+    unsigned long index;
+    void *entry;
+
+    xa_for_each(&layer->pages, index, entry) {
+        if (!xa_is_value(entry))
+            __free_page(entry);
+    }
+    xa_destroy(&layer->pages);
+    kfree(layer);
+    if (parent)
+        kref_put(&parent->ref, sbd_release_layer);
+}
+
+static enum sbd_numa_policy sbd_numa;
+
+// Node for the page at index. Local placement uses the node of the CPU
+// running the request, which blk-mq keeps within the hardware queue's CPU
+// set, so each queue fills its own node's memory.
+static int sbd_page_node(pgoff_t index) {
+    unsigned int n;
+    int nid;
+
+    switch (sbd_numa) {
+    case SBD_NUMA_INTERLEAVE:
+        n = (index >> SBD_NUMA_CHUNK_SHIFT) % num_online_nodes();
+        for_each_online_node(nid)
+            if (!n--)
+                return nid;
+        return numa_node_id();
+    case SBD_NUMA_BIND:
+        return numa_node;
+    default:
+        return numa_node_id();
+    }
+}
+
+static struct page *sbd_alloc_page(pgoff_t index, gfp_t gfp) {
+    // Bound pages must not quietly fall back to another node.
+    if (sbd_numa == SBD_NUMA_BIND)
+        gfp |= __GFP_THISNODE;
+    return alloc_pages_node(sbd_page_node(index), gfp, 0);
+}
+
+static inline void sbd_count_numa(struct sbd_struct *dev, struct page *page) {
+    if (!static_branch_unlikely(&sbd_stats_enabled))
+        return;
+    if (page_to_nid(page) == numa_node_id())
+        this_cpu_inc(dev->stats->numa_hits);
+    else
+        this_cpu_inc(dev->stats->numa_misses);
+}
+
+static struct page *sbd_insert_page(struct sbd_struct *dev, sector_t sector, gfp_t gfp) {
+    pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+    struct page *page, *old, *cur, *src;
+
+    old = xa_load(&dev->top->pages, index);
+    if (old && !xa_is_value(old))
+        return old;
+
+    page = sbd_alloc_page(index, gfp | __GFP_ZERO | __GFP_HIGHMEM);
+    if (!page)
+        return NULL;
+
+    // First write since a snapshot: copy the shared page up, even for a
+    // full page write, which keeps callers unaware of layering.
+    if (!old && dev->top->parent) {
+        rcu_read_lock();
+        src = sbd_lookup_page(dev, sector);
+        if (src)
+            copy_highpage(page, src);
+        rcu_read_unlock();
+    }
+
+    xa_lock(&dev->top->pages);
+    cur = __xa_cmpxchg(&dev->top->pages, index, old, page, gfp);
+    if (unlikely(cur != old)) {
+        // Lost the race against another writer, or the xarray node
+        // allocation failed; either way our page is not needed.
+        __free_page(page);
+        page = xa_is_err(cur) || xa_is_value(cur) ? NULL : cur;
+    } else {
+        dev->top->nr_pages++;
+    }
+    xa_unlock(&dev->top->pages);
+    return page;
+}
+
+static void sbd_free_page_rcu(struct rcu_head *head) {
+    __free_page(container_of(head, struct page, rcu_head));
+}
+
+static void sbd_zfree_entry(struct sbd_struct *dev, struct sbd_zentry *entry) {
+    if (entry->size) {
+        zs_free(dev->zpool, entry->handle);
+        atomic64_sub(entry->size, &dev->compr_bytes);
+        if (entry->size == PAGE_SIZE)
+            atomic64_dec(&dev->huge_pages);
+    } else {
+        atomic64_dec(&dev->same_pages);
+    }
+    kmem_cache_free(sbd_zentry_cache, entry);
+}
+
+static void sbd_free_pages(struct sbd_struct *dev) {
+    unsigned long index;
+    void *entry;
+
+    xa_for_each(&dev->top->pages, index, entry) {
+        if (dev->zpool)
+            sbd_zfree_entry(dev, entry);
+        else if (!xa_is_value(entry))
+            __free_page(entry);
+    }
+    xa_destroy(&dev->top->pages);
+    dev->top->nr_pages = 0;
+}
+
+static bool sbd_page_same_filled(const void *ptr, unsigned long *element) {
+    const unsigned long *words = ptr;
+    unsigned int pos, last = PAGE_SIZE / sizeof(*words) - 1;
+
+    if (words[last] != words[0])
+        return false;
+    for (pos = 1; pos < last; pos++) {
+        if (words[pos] != words[0])
+            return false;
+    }
+    *element = words[0];
+    return true;
+}
+
+// Decompress part of the page at index into dst. Never sleeps, so it is
+// safe under kmap_atomic(); the caller holds the page's stripe.
+static int sbd_zread_page(struct sbd_struct *dev, pgoff_t index, void *dst,
+                          unsigned int offset, unsigned int len) {
+    struct sbd_zentry *entry = xa_load(&dev->top->pages, index);
+    struct sbd_zstream *zstrm;
+    unsigned int dlen = PAGE_SIZE;
+    u64 start = 0;
+    void *src;
+    int ret = 0;
+
+    if (!entry) {
+        memset(dst, 0, len);
+        return 0;
+    }
+    if (!entry->size) {
+        // Offsets and lengths are whole sectors, so the word pattern lines up.
+        memset_l(dst, entry->handle, len / sizeof(unsigned long));
+        return 0;
+    }
+
+    src = zs_map_object(dev->zpool, entry->handle, ZS_MM_RO);
+    if (entry->size == PAGE_SIZE) {
+        memcpy(dst, src + offset, len);
+    } else {
+        zstrm = get_cpu_ptr(sbd_zstreams);
+        if (static_branch_unlikely(&sbd_stats_enabled))
+            start = ktime_get_ns();
+        if (offset == 0 && len == PAGE_SIZE) {
+            ret = crypto_comp_decompress(zstrm->tfm, src, entry->size, dst, &dlen);
+        } else {
+            ret = crypto_comp_decompress(zstrm->tfm, src, entry->size, zstrm->scratch, &dlen);
+            if (!ret)
+                memcpy(dst, zstrm->scratch + offset, len);
+        }
+        if (start) {
+            this_cpu_inc(dev->stats->decompressions);
+            this_cpu_add(dev->stats->decompress_ns, ktime_get_ns() - start);
+        }
+        put_cpu_ptr(sbd_zstreams);
+    }
+    zs_unmap_object(dev->zpool, entry->handle);
+
+    if (unlikely(ret || dlen != PAGE_SIZE)) {
+        pr_err_ratelimited("[sbd] Decompression of page %lu failed!\n", index);
+        return -EIO;
+    }
+    return 0;
+}
+
+// Compress a full page and replace whatever was stored at index. May sleep.
+static int sbd_zwrite_page(struct sbd_struct *dev, pgoff_t index, const void *src) {
+    struct sbd_zentry *entry, *old;
+    struct sbd_zstream *zstrm;
+    unsigned long handle, element;
+    unsigned int clen;
+    const void *data;
+    u64 start = 0;
+    void *dst;
+
+    if (sbd_page_same_filled(src, &element)) {
+        handle = element;
+        clen = 0;
+        if (!element) {
+            entry = NULL;
+            goto store;
+        }
+        goto alloc_entry;
+    }
+
+    handle = 0;
+    zstrm = get_cpu_ptr(sbd_zstreams);
+compress_again:
+    if (static_branch_unlikely(&sbd_stats_enabled))
+        start = ktime_get_ns();
+    clen = 2 * PAGE_SIZE;
+    if (crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE, zstrm->buffer, &clen) ||
+        clen >= SBD_HUGE_SIZE) {
+        clen = PAGE_SIZE;
+        data = src;
+    } else {
+        data = zstrm->buffer;
+    }
+    if (start) {
+        this_cpu_inc(dev->stats->compressions);
+        this_cpu_add(dev->stats->compress_ns, ktime_get_ns() - start);
+    }
+
+    // Try without sleeping first. On failure drop the stream, allocate
+    // with reclaim and compress again, as the output buffer is per CPU and
+    // may have been reused meanwhile; the result has the same size.
+    if (!handle) {
+        handle = zs_malloc(dev->zpool, clen, __GFP_KSWAPD_RECLAIM | __GFP_NOWARN |
+                                             __GFP_HIGHMEM | __GFP_MOVABLE);
+        if (!handle) {
+            put_cpu_ptr(sbd_zstreams);
+            handle = zs_malloc(dev->zpool, clen, GFP_NOIO | __GFP_HIGHMEM | __GFP_MOVABLE);
+            if (!handle)
+                return -ENOMEM;
+            zstrm = get_cpu_ptr(sbd_zstreams);
+            goto compress_again;
+        }
+    }
+    dst = zs_map_object(dev->zpool, handle, ZS_MM_WO);
+    memcpy(dst, data, clen);
+    zs_unmap_object(dev->zpool, handle);
+    put_cpu_ptr(sbd_zstreams);
+
+alloc_entry:
+    entry = kmem_cache_alloc(sbd_zentry_cache, GFP_NOIO);
+    if (!entry) {
+        if (clen)
+            zs_free(dev->zpool, handle);
+        return -ENOMEM;
+    }
+    entry->handle = handle;
+    entry->size = clen;
+    if (!clen)
+        atomic64_inc(&dev->same_pages);
+    else
+        atomic64_add(clen, &dev->compr_bytes);
+    if (clen == PAGE_SIZE)
+        atomic64_inc(&dev->huge_pages);
+
+store:
+    xa_lock(&dev->top->pages);
+    old = entry ? __xa_store(&dev->top->pages, index, entry, GFP_NOIO)
+                : __xa_erase(&dev->top->pages, index);
+    if (xa_is_err(old)) {
+        xa_unlock(&dev->top->pages);
+        sbd_zfree_entry(dev, entry);
+        return xa_err(old);
+    }
+    if (!old && entry)
+        dev->top->nr_pages++;
+    else if (old && !entry)
+        dev->top->nr_pages--;
+    xa_unlock(&dev->top->pages);
+    if (old)
+        sbd_zfree_entry(dev, old);
+    return 0;
+}
+
+// Compressed counterpart of sbd_prepare_write() plus sbd_copy_to(). Partial
+// pages are read, patched in a bounce page and compressed again.
+static int sbd_zcopy_to(struct sbd_struct *dev, const void *src, sector_t sector, size_t n) {
+    unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+    void *bounce = NULL;
+    size_t chunk;
+    int ret = 0;
+
+    while (n) {
+        chunk = min_t(size_t, n, PAGE_SIZE - offset);
+        if (chunk == PAGE_SIZE) {
+            ret = sbd_zwrite_page(dev, sector >> PAGE_SECTORS_SHIFT, src);
+        } else {
+            if (!bounce) {
+                bounce = kmalloc(PAGE_SIZE, GFP_NOIO);
+                if (!bounce) {
+                    ret = -ENOMEM;
+                    break;
+                }
+            }
+            ret = sbd_zread_page(dev, sector >> PAGE_SECTORS_SHIFT, bounce, 0, PAGE_SIZE);
+            if (!ret) {
+                if (src)
+                    memcpy(bounce + offset, src, chunk);
+                else
+                    memset(bounce + offset, 0, chunk);
+                ret = sbd_zwrite_page(dev, sector >> PAGE_SECTORS_SHIFT, bounce);
+            }
+        }
+        if (ret)
+            break;
+        if (src)
+            src += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        n -= chunk;
+        offset = 0;
+    }
+    kfree(bounce);
+    return ret;
+}
+
+static int sbd_zcopy_from(struct sbd_struct *dev, void *dst, sector_t sector, size_t n) {
+    unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+    size_t chunk;
+    int ret;
+
+    while (n) {
+        chunk = min_t(size_t, n, PAGE_SIZE - offset);
+        ret = sbd_zread_page(dev, sector >> PAGE_SECTORS_SHIFT, dst, offset, chunk);
+        if (ret)
+            return ret;
+        dst += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        n -= chunk;
+        offset = 0;
+    }
+    return 0;
+}
+
+// Bring the file contents of one page into the store on first access. Pages
+// that are all zeroes in the file stay holes. Readers share the stripe, so
+// two of them may race here; the loser's copy is dropped.
+static int sbd_fault_in(struct sbd_struct *dev, pgoff_t index) {
+    loff_t pos = (loff_t)index << PAGE_SHIFT;
+    struct page *page, *cur;
+    unsigned int noio;
+    ssize_t ret;
+    void *addr;
+
+    if (test_bit(index, dev->loaded))
+        return 0;
+
+    page = sbd_alloc_page(index, GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM);
+    if (!page)
+        return -ENOMEM;
+    // Like loop, keep reclaim from recursing into the device we serve.
+    noio = memalloc_noio_save();
+    addr = kmap(page);
+    ret = kernel_read(dev->file, addr, PAGE_SIZE, &pos);
+    if (ret >= 0 && !memchr_inv(addr, 0, PAGE_SIZE))
+        ret = 0;
+    kunmap(page);
+    memalloc_noio_restore(noio);
+
+    if (ret < 0) {
+        __free_page(page);
+        pr_err_ratelimited("[sbd] Reading page %lu from the backing file failed!\n", index);
+        return ret;
+    }
+    if (ret == 0) {
+        // A hole or a short read past the end of the file.
+        __free_page(page);
+    } else {
+        xa_lock(&dev->top->pages);
+        cur = __xa_cmpxchg(&dev->top->pages, index, NULL, page, GFP_NOIO);
+        if (cur)
+            __free_page(page);
         else
-            memcpy((void *)(addr + vector.bv_offset), (void *)(sbd_dev.memory + sector * sector_size), len);
-        kunmap(addr);
-        sector += len >> 9;
+            dev->top->nr_pages++;
+        xa_unlock(&dev->top->pages);
+        if (xa_is_err(cur))
+            return xa_err(cur);
     }
+    atomic64_inc(&dev->faults);
+    smp_mb__before_atomic();
+    set_bit(index, dev->loaded);
     return 0;
 }
 
-static blk_qc_t make_request(struct request_queue *q, struct bio *bio) {
-    int result = 0;
+static int sbd_prepare_read(struct sbd_struct *dev, sector_t sector, size_t n) {
+    pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+    pgoff_t last = (sector + (n >> SECTOR_SHIFT) - 1) >> PAGE_SECTORS_SHIFT;
+    int ret;
 
-    if (bio_end_sector(bio) > get_capacity(bio->bi_bdev->bd_disk)) {
-        bio_io_error(bio);
-        return BLK_QC_T_NONE;
+    for (; index <= last; index++) {
+        ret = sbd_fault_in(dev, index);
+        if (ret)
+            return ret;
     }
+    return 0;
+}
 
-    result = transfer_single_bio(bio);
-    if (unlikely(result != 0)) {
-        bio_io_error(bio);
-        return BLK_QC_T_NONE;
+// Called once the data is in the store. The barrier orders the copy before
+// the dirty bit, which writeback clears before it reads the page.
+static void sbd_mark_dirty(struct sbd_struct *dev, sector_t sector, size_t n) {
+    pgoff_t index = sector >> PAGE_SECTORS_SHIFT;
+    pgoff_t last = (sector + (n >> SECTOR_SHIFT) - 1) >> PAGE_SECTORS_SHIFT;
+
+    smp_mb__before_atomic();
+    for (; index <= last; index++) {
+        set_bit(index, dev->loaded);
+        set_bit(index, dev->dirty);
     }
+}
+
+// Write dirty pages back in runs of up to SBD_WB_BATCH adjacent pages, each
+// run with one vfs_iter_write() straight from the backing pages. Holes are
+// written from the zero page. A page changed while its run is in flight is
+// dirty again afterwards and goes out with the next pass.
+static int sbd_writeback(struct sbd_struct *dev) {
+    struct page *page;
+    struct iov_iter iter;
+    unsigned long index, n, i;
+    unsigned int noio;
+    ssize_t written;
+    loff_t pos;
+    int ret = 0;
 
-    bio_endio(bio);
-    return BLK_QC_T_NONE;
+    mutex_lock(&dev->wb_mutex);
+    noio = memalloc_noio_save();
+    index = find_first_bit(dev->dirty, dev->store_pages);
+    while (index < dev->store_pages) {
+        for (n = 0; n < SBD_WB_BATCH && index + n < dev->store_pages; n++) {
+            if (!test_and_clear_bit(index + n, dev->dirty))
+                break;
+            rcu_read_lock();
+            page = xa_load(&dev->top->pages, index + n);
+            if (page && !get_page_unless_zero(page))
+                page = NULL;
+            rcu_read_unlock();
+            dev->wb_bvec[n].bv_page = page ? page : ZERO_PAGE(0);
+            dev->wb_bvec[n].bv_len = PAGE_SIZE;
+            dev->wb_bvec[n].bv_offset = 0;
+        }
+
+        iov_iter_bvec(&iter, WRITE, dev->wb_bvec, n, n << PAGE_SHIFT);
+        pos = (loff_t)index << PAGE_SHIFT;
+        written = vfs_iter_write(dev->file, &iter, &pos, 0);
+
+        for (i = 0; i < n; i++) {
+            if (written != n << PAGE_SHIFT)
+                set_bit(index + i, dev->dirty);
+            if (dev->wb_bvec[i].bv_page != ZERO_PAGE(0))
+                put_page(dev->wb_bvec[i].bv_page);
+        }
+        if (written != n << PAGE_SHIFT) {
+            ret = written < 0 ? written : -EIO;
+            pr_err_ratelimited("[sbd] Writeback to the backing file failed: %d!\n", ret);
+            break;
+        }
+        atomic64_add(n, &dev->written_back);
+        index = find_next_bit(dev->dirty, dev->store_pages, index + n);
+    }
+    memalloc_noio_restore(noio);
+    mutex_unlock(&dev->wb_mutex);
+    return ret;
+}
+
+// Everything acknowledged before a flush is on stable storage after it.
+static int sbd_checkpoint(struct sbd_struct *dev) {
+    int ret = sbd_writeback(dev);
+
+    return ret ? ret : vfs_fsync(dev->file, 0);
+}
+
+static void sbd_writeback_work(struct work_struct *work) {
+    struct sbd_struct *dev = container_of(to_delayed_work(work), struct sbd_struct, wb_work);
+
+    sbd_writeback(dev);
+    queue_delayed_work(system_unbound_wq, &dev->wb_work, msecs_to_jiffies(writeback_ms));
+}
+
+// Make sure every backing page touched by [sector, sector + n) exists
+// before the segment is mapped, since allocation may sleep. Partially
+// written pages need their file contents first.
+static int sbd_prepare_write(struct sbd_struct *dev, sector_t sector, size_t n) {
+    unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+    size_t chunk;
+    int ret;
+
+    while (n) {
+        chunk = min_t(size_t, n, PAGE_SIZE - offset);
+        if (dev->file && chunk != PAGE_SIZE) {
+            ret = sbd_fault_in(dev, sector >> PAGE_SECTORS_SHIFT);
+            if (ret)
+                return ret;
+        }
+        if (!sbd_insert_page(dev, sector, GFP_NOIO))
+            return -ENOMEM;
+        sector += chunk >> SECTOR_SHIFT;
+        n -= chunk;
+        offset = 0;
+    }
+    return 0;
+}
+
+static void sbd_copy_to(struct sbd_struct *dev, const void *src, sector_t sector, size_t n) {
+    unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+    struct page *page;
+    size_t chunk;
+    void *dst;
+
+    while (n) {
+        chunk = min_t(size_t, n, PAGE_SIZE - offset);
+        rcu_read_lock();
+        page = sbd_lookup_page(dev, sector);
+        // sbd_prepare_write() ran under the same exclusive range lock.
+        if (!WARN_ON_ONCE(!page)) {
+            sbd_count_numa(dev, page);
+            dst = kmap_atomic(page);
+            memcpy(dst + offset, src, chunk);
+            kunmap_atomic(dst);
+        }
+        rcu_read_unlock();
+        src += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        n -= chunk;
+        offset = 0;
+    }
+}
+
+static int sbd_copy_from(struct sbd_struct *dev, void *dst, sector_t sector, size_t n) {
+    unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+    struct page *page;
+    size_t chunk;
+    void *src;
+
+    if (dev->zpool)
+        return sbd_zcopy_from(dev, dst, sector, n);
+
+    while (n) {
+        chunk = min_t(size_t, n, PAGE_SIZE - offset);
+        rcu_read_lock();
+        page = sbd_lookup_page(dev, sector);
+        if (page) {
+            sbd_count_numa(dev, page);
+            src = kmap_atomic(page);
+            memcpy(dst, src + offset, chunk);
+            kunmap_atomic(src);
+        } else {
+            // Never written or discarded: holes read back as zeroes.
+            memset(dst, 0, chunk);
+        }
+        rcu_read_unlock();
+        dst += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        n -= chunk;
+        offset = 0;
+    }
+    return 0;
+}
+
+// Discard and write-zeroes both only touch the page map: whole pages are
+// unlinked and freed after an RCU grace period, so readers that already
+// looked them up finish safely. Only partially covered pages are cleared.
+// Compressed entries are protected by the exclusive range lock alone.
+static int sbd_discard(struct sbd_struct *dev, sector_t sector, size_t n) {
+    unsigned int offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+    struct sbd_zentry *entry;
+    struct page *page;
+    size_t chunk;
+    void *dst;
+    int ret;
+
+    while (n) {
+        chunk = min_t(size_t, n, PAGE_SIZE - offset);
+        if (dev->zpool && chunk == PAGE_SIZE) {
+            xa_lock(&dev->top->pages);
+            entry = __xa_erase(&dev->top->pages, sector >> PAGE_SECTORS_SHIFT);
+            if (entry)
+                dev->top->nr_pages--;
+            xa_unlock(&dev->top->pages);
+            if (entry)
+                sbd_zfree_entry(dev, entry);
+        } else if (dev->zpool) {
+            ret = sbd_zcopy_to(dev, NULL, sector, chunk);
+            if (ret)
+                return ret;
+        } else if (chunk == PAGE_SIZE) {
+            // Over a frozen layer a hole would expose the shared page.
+            xa_lock(&dev->top->pages);
+            if (dev->top->parent)
+                page = __xa_store(&dev->top->pages, sector >> PAGE_SECTORS_SHIFT,
+                                  SBD_TOMBSTONE, GFP_NOIO);
+            else
+                page = __xa_erase(&dev->top->pages, sector >> PAGE_SECTORS_SHIFT);
+            if (xa_is_err(page)) {
+                xa_unlock(&dev->top->pages);
+                return xa_err(page);
+            }
+            if (xa_is_value(page))
+                page = NULL;
+            if (page)
+                dev->top->nr_pages--;
+            xa_unlock(&dev->top->pages);
+            if (page)
+                call_rcu(&page->rcu_head, sbd_free_page_rcu);
+            // With a backing file the page is now known to be zero, and the
+            // zeroes still have to reach the file.
+            if (dev->file)
+                sbd_mark_dirty(dev, sector, chunk);
+        } else {
+            if (dev->file) {
+                ret = sbd_fault_in(dev, sector >> PAGE_SECTORS_SHIFT);
+                if (ret)
+                    return ret;
+            }
+            if (dev->top->parent && !sbd_insert_page(dev, sector, GFP_NOIO))
+                return -ENOMEM;
+            rcu_read_lock();
+            page = sbd_lookup_page(dev, sector);
+            if (page) {
+                dst = kmap_atomic(page);
+                memset(dst + offset, 0, chunk);
+                kunmap_atomic(dst);
+            }
+            rcu_read_unlock();
+            if (dev->file)
+                sbd_mark_dirty(dev, sector, chunk);
+        }
+        sector += chunk >> SECTOR_SHIFT;
+        n -= chunk;
+        offset = 0;
+    }
+    return 0;
+}
+
+// Stripes covering [sector, sector + sectors) as at most two ascending runs.
+static int sbd_stripe_runs(sector_t sector, u64 sectors, unsigned int runs[2][2]) {
+    sector_t first = sector >> SBD_STRIPE_SHIFT;
+    sector_t last = (sector + max_t(u64, sectors, 1) - 1) >> SBD_STRIPE_SHIFT;
+    unsigned int mask = lock_stripes - 1;
+
+    if (last - first >= mask) {
+        runs[0][0] = 0;
+        runs[0][1] = mask;
+        return 1;
+    }
+    if ((first & mask) <= (last & mask)) {
+        runs[0][0] = first & mask;
+        runs[0][1] = last & mask;
+        return 1;
+    }
+    runs[0][0] = 0;
+    runs[0][1] = last & mask;
+    runs[1][0] = first & mask;
+    runs[1][1] = mask;
+    return 2;
+}
+
+// Stripes are always taken in ascending index order, so overlapping
+// requests queue behind each other instead of deadlocking. A request may
+// hold every stripe, far more locks of one class than lockdep can nest, so
+// lockdep sees the whole range as a single acquisition of range_map and
+// the stripes themselves are taken with lockdep off.
+static void sbd_range_lock(struct sbd_struct *dev, sector_t sector, u64 sectors, bool write) {
+    unsigned int runs[2][2], i;
+    int r, nr = sbd_stripe_runs(sector, sectors, runs);
+
+    if (write)
+        rwsem_acquire(&dev->range_map, 0, 0, _RET_IP_);
+    else
+        rwsem_acquire_read(&dev->range_map, 0, 0, _RET_IP_);
+    lockdep_off();
+    for (r = 0; r < nr; r++) {
+        for (i = runs[r][0]; i <= runs[r][1]; i++) {
+            if (write)
+                down_write(&dev->stripes[i].lock);
+            else
+                down_read(&dev->stripes[i].lock);
+        }
+    }
+    lockdep_on();
+}
+
+static void sbd_range_unlock(struct sbd_struct *dev, sector_t sector, u64 sectors, bool write) {
+    unsigned int runs[2][2], i;
+    int r, nr = sbd_stripe_runs(sector, sectors, runs);
+
+    lockdep_off();
+    for (r = 0; r < nr; r++) {
+        for (i = runs[r][0]; i <= runs[r][1]; i++) {
+            if (write)
+                up_write(&dev->stripes[i].lock);
+            else
+                up_read(&dev->stripes[i].lock);
+        }
+    }
+    lockdep_on();
+    rwsem_release(&dev->range_map, _RET_IP_);
+}
+
+static int sbd_alloc_stripes(struct sbd_struct *dev) {
+    static struct lock_class_key range_key;
+    unsigned int i;
+
+    dev->stripes = kcalloc(lock_stripes, sizeof(*dev->stripes), GFP_KERNEL);
+    if (!dev->stripes)
+        return -ENOMEM;
+    for (i = 0; i < lock_stripes; i++)
+        init_rwsem(&dev->stripes[i].lock);
+    lockdep_init_map(&dev->range_map, "sbd_range", &range_key, 0);
+    return 0;
+}
+
+static inline int transfer_request(struct sbd_struct *dev, struct request *rq) {
+    struct req_iterator iter;
+    struct bio_vec vector;
+    sector_t sector = blk_rq_pos(rq);
+    bool write = rq_data_dir(rq) == WRITE;
+    void *bounce = NULL;
+    int ret = 0;
+
+    // The whole request holds its range, so overlapping requests never
+    // observe each other half done.
+    sbd_range_lock(dev, blk_rq_pos(rq), blk_rq_sectors(rq), write);
+    rq_for_each_segment(vector, rq, iter) {
+        unsigned int len = vector.bv_len;
+        void *addr;
+
+        if (write && dev->zpool) {
+            // Compressed writes may sleep, so they go through a bounce page.
+            if (!bounce) {
+                bounce = kmalloc(PAGE_SIZE, GFP_NOIO);
+                if (!bounce) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+            }
+            addr = kmap_atomic(vector.bv_page);
+            memcpy(bounce, addr + vector.bv_offset, len);
+            kunmap_atomic(addr);
+            ret = sbd_zcopy_to(dev, bounce, sector, len);
+        } else if (write) {
+            ret = sbd_prepare_write(dev, sector, len);
+            if (!ret) {
+                addr = kmap_atomic(vector.bv_page);
+                sbd_copy_to(dev, addr + vector.bv_offset, sector, len);
+                kunmap_atomic(addr);
+                if (dev->file)
+                    sbd_mark_dirty(dev, sector, len);
+            }
+        } else {
+            if (dev->file) {
+                ret = sbd_prepare_read(dev, sector, len);
+                if (ret)
+                    goto out;
+            }
+            addr = kmap_atomic(vector.bv_page);
+            ret = sbd_copy_from(dev, addr + vector.bv_offset, sector, len);
+            kunmap_atomic(addr);
+        }
+        // rq_for_each_segment() is two nested loops, so break would only
+        // leave the current bio.
+        if (ret)
+            goto out;
+        sector += len >> SECTOR_SHIFT;
+    }
+out:
+    sbd_range_unlock(dev, blk_rq_pos(rq), blk_rq_sectors(rq), write);
+    kfree(bounce);
+    return ret;
+}
+
+static inline unsigned int sbd_hist_bucket(u64 value) {
+    return min_t(unsigned int, fls64(value), SBD_HIST_BUCKETS - 1);
+}
+
+static void sbd_account(struct sbd_struct *dev, struct request *rq, u64 latency) {
+    struct sbd_stats *stats = get_cpu_ptr(dev->stats);
+    int dir = rq_data_dir(rq);
+
+    if (req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE) {
+        stats->ios[dir]++;
+        stats->bytes[dir] += blk_rq_bytes(rq);
+        stats->segments[sbd_hist_bucket(blk_rq_nr_phys_segments(rq))]++;
+        stats->sizes[sbd_hist_bucket(blk_rq_bytes(rq))]++;
+        stats->latency[dir][sbd_hist_bucket(latency)]++;
+    } else if (req_op(rq) == REQ_OP_DISCARD || req_op(rq) == REQ_OP_WRITE_ZEROES) {
+        stats->discards++;
+    }
+    put_cpu_ptr(dev->stats);
+}
+
+static void sbd_complete(struct sbd_struct *dev, struct request *rq) {
+    struct sbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    if (static_branch_unlikely(&sbd_stats_enabled) && cmd->start && cmd->status == BLK_STS_OK)
+        sbd_account(dev, rq, ktime_get_ns() - cmd->start);
+    blk_mq_end_request(rq, cmd->status);
+}
+
+static blk_status_t queue_request(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
+    struct sbd_struct *dev = hctx->queue->queuedata;
+    struct request *rq = bd->rq;
+    struct sbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    blk_status_t status = BLK_STS_OK;
+    struct sbd_poll_queue *pq;
+    int ret;
+
+    cmd->start = 0;
+    if (static_branch_unlikely(&sbd_stats_enabled))
+        cmd->start = ktime_get_ns();
+    blk_mq_start_request(rq);
+
+    if (blk_rq_pos(rq) + blk_rq_sectors(rq) > get_capacity(dev->gd)) {
+        status = BLK_STS_IOERR;
+        goto end;
+    }
+    // The block layer only warns about writes to a read-only disk.
+    if (unlikely(dev->read_only && op_is_write(req_op(rq)))) {
+        status = BLK_STS_IOERR;
+        goto end;
+    }
+
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        ret = transfer_request(dev, rq);
+        if (unlikely(ret != 0))
+            status = errno_to_blk_status(ret);
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        // REQ_NOUNMAP is ignored: a dropped page already reads as zeroes.
+        sbd_range_lock(dev, blk_rq_pos(rq), blk_rq_sectors(rq), true);
+        ret = sbd_discard(dev, blk_rq_pos(rq), blk_rq_bytes(rq));
+        sbd_range_unlock(dev, blk_rq_pos(rq), blk_rq_sectors(rq), true);
+        if (unlikely(ret != 0))
+            status = errno_to_blk_status(ret);
+        break;
+    case REQ_OP_FLUSH:
+        // Without a backing file nothing is cached in front of the pages.
+        if (dev->file) {
+            ret = sbd_checkpoint(dev);
+            if (unlikely(ret != 0))
+                status = errno_to_blk_status(ret);
+        }
+        break;
+    default:
+        status = BLK_STS_NOTSUPP;
+        break;
+    }
+
+end:
+    cmd->status = status;
+    if (hctx->type == HCTX_TYPE_POLL) {
+        pq = hctx->driver_data;
+        spin_lock(&pq->lock);
+        list_add_tail(&rq->queuelist, &pq->done);
+        spin_unlock(&pq->lock);
+        return BLK_STS_OK;
+    }
+    sbd_complete(dev, rq);
+    return BLK_STS_OK;
+}
+
+static int sbd_poll(struct blk_mq_hw_ctx *hctx) {
+    struct sbd_struct *dev = hctx->queue->queuedata;
+    struct sbd_poll_queue *pq = hctx->driver_data;
+    struct request *rq, *next;
+    LIST_HEAD(list);
+    int nr = 0;
+
+    spin_lock(&pq->lock);
+    list_splice_init(&pq->done, &list);
+    spin_unlock(&pq->lock);
+
+    list_for_each_entry_safe(rq, next, &list, queuelist) {
+        list_del_init(&rq->queuelist);
+        sbd_complete(dev, rq);
+        nr++;
+    }
+    return nr;
+}
+
+static int sbd_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx) {
+    struct sbd_struct *dev = data;
+
+    hctx->driver_data = &dev->poll[hctx_idx];
+    return 0;
+}
+
+// The first queues serve regular I/O, the last poll_queues only polled I/O.
+static int sbd_map_queues(struct blk_mq_tag_set *set) {
+    struct blk_mq_queue_map *map;
+    unsigned int offset = 0;
+    int type;
+
+    for (type = 0; type < set->nr_maps; type++) {
+        map = &set->map[type];
+        switch (type) {
+        case HCTX_TYPE_DEFAULT:
+            map->nr_queues = set->nr_hw_queues - poll_queues;
+            break;
+        case HCTX_TYPE_POLL:
+            map->nr_queues = poll_queues;
+            break;
+        default:
+            // Reads share the default queues.
+            map->nr_queues = 0;
+            continue;
+        }
+        map->queue_offset = offset;
+        offset += map->nr_queues;
+        blk_mq_map_queues(map);
+    }
+    return 0;
+}
+
+static const struct blk_mq_ops sbd_mq_ops = {
+    .queue_rq = queue_request,
+    .init_hctx = sbd_init_hctx,
+    .map_queues = sbd_map_queues,
+    .poll = sbd_poll,
+};
+
+static int sbd_snapshot(struct sbd_struct *origin, bool writable);
+static int sbd_delete_snapshot(unsigned long minor);
+
+static int sbd_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg) {
+    struct sbd_struct *dev = bdev->bd_disk->private_data;
+
+    if (cmd != SBD_IOC_SNAPSHOT && cmd != SBD_IOC_DELETE)
+        return -ENOTTY;
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (cmd == SBD_IOC_DELETE)
+        return sbd_delete_snapshot(arg);
+    return sbd_snapshot(dev, arg != 0);
+}
+
+// Openers are counted so that a snapshot is only deleted while unused.
+static int sbd_open(struct block_device *bdev, fmode_t mode) {
+    struct sbd_struct *dev = bdev->bd_disk->private_data;
+    int ret = 0;
+
+    spin_lock(&sbd_open_lock);
+    if (dev->deleting)
+        ret = -ENXIO;
+    else
+        dev->openers++;
+    spin_unlock(&sbd_open_lock);
+    return ret;
+}
+
+static void sbd_release(struct gendisk *disk, fmode_t mode) {
+    struct sbd_struct *dev = disk->private_data;
+
+    spin_lock(&sbd_open_lock);
+    dev->openers--;
+    spin_unlock(&sbd_open_lock);
 }
 
 static struct block_device_operations block_methods = {
-    .owner = THIS_MODULE
+    .owner = THIS_MODULE,
+    .open = sbd_open,
+    .release = sbd_release,
+    .ioctl = sbd_ioctl,
 };
 
-static int __init sbd_constructor(void) {
-    sbd_dev.memory = vmalloc(DEVICE_SIZE);
-    if (!sbd_dev.memory) {
-        pr_alert("Memory allocation error!\n");
+static void sbd_show_hist(struct seq_file *m, const char *title, const u64 *hist) {
+    int b;
+
+    seq_printf(m, "%s:\n", title);
+    for (b = 0; b < SBD_HIST_BUCKETS; b++) {
+        if (!hist[b])
+            continue;
+        seq_printf(m, "  %9llu - %-9llu %llu\n", b ? 1ULL << (b - 1) : 0,
+                   b ? (1ULL << b) - 1 : 0, hist[b]);
+    }
+}
+
+// Deleting a snapshot may free frozen layers, so the chain is only walked
+// under the snapshot mutex.
+static unsigned int sbd_layer_depth(struct sbd_struct *dev) {
+    struct sbd_layer *layer;
+    unsigned int depth = 0;
+
+    mutex_lock(&sbd_snapshot_mutex);
+    for (layer = dev->top; layer; layer = layer->parent)
+        depth++;
+    mutex_unlock(&sbd_snapshot_mutex);
+    return depth;
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+    struct sbd_struct *dev = m->private;
+    struct sbd_stats *sum, *stats;
+    int cpu, node, b;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
         return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(dev->stats, cpu);
+        sum->ios[READ] += stats->ios[READ];
+        sum->ios[WRITE] += stats->ios[WRITE];
+        sum->bytes[READ] += stats->bytes[READ];
+        sum->bytes[WRITE] += stats->bytes[WRITE];
+        sum->discards += stats->discards;
+        sum->compressions += stats->compressions;
+        sum->compress_ns += stats->compress_ns;
+        sum->decompressions += stats->decompressions;
+        sum->decompress_ns += stats->decompress_ns;
+        for (b = 0; b < SBD_HIST_BUCKETS; b++) {
+            sum->segments[b] += stats->segments[b];
+            sum->sizes[b] += stats->sizes[b];
+            sum->latency[READ][b] += stats->latency[READ][b];
+            sum->latency[WRITE][b] += stats->latency[WRITE][b];
+        }
     }
 
-    sbd_dev.gd = alloc_disk(1);
-    if (!sbd_dev.gd) {
-        pr_alert("General disk structure allocation error!\n");
-        vfree(sbd_dev.memory);
+    seq_printf(m, "enabled: %d\n", static_key_enabled(&sbd_stats_enabled));
+    seq_printf(m, "backing_pages: %lu\n", dev->top->nr_pages);
+    seq_printf(m, "layers: %u\n", sbd_layer_depth(dev));
+    seq_printf(m, "reads: %llu\nwrites: %llu\n", sum->ios[READ], sum->ios[WRITE]);
+    seq_printf(m, "read_bytes: %llu\nwrite_bytes: %llu\n", sum->bytes[READ], sum->bytes[WRITE]);
+    seq_printf(m, "discards: %llu\n", sum->discards);
+    if (dev->file) {
+        seq_printf(m, "dirty_pages: %u\n", bitmap_weight(dev->dirty, dev->store_pages));
+        seq_printf(m, "faulted_in_pages: %lld\n", atomic64_read(&dev->faults));
+        seq_printf(m, "written_back_pages: %lld\n", atomic64_read(&dev->written_back));
+    }
+    if (dev->zpool) {
+        u64 stored = (u64)dev->top->nr_pages << PAGE_SHIFT;
+        u64 pool = (u64)zs_get_total_pages(dev->zpool) << PAGE_SHIFT;
+
+        seq_printf(m, "compression: %s\n", compress);
+        seq_printf(m, "same_filled_pages: %lld\n", atomic64_read(&dev->same_pages));
+        seq_printf(m, "incompressible_pages: %lld\n", atomic64_read(&dev->huge_pages));
+        seq_printf(m, "compressed_bytes: %lld\n", atomic64_read(&dev->compr_bytes));
+        seq_printf(m, "pool_bytes: %llu\n", pool);
+        seq_printf(m, "compression_ratio: %llu.%02llu\n", pool ? stored / pool : 0,
+                   pool ? stored * 100 / pool % 100 : 0);
+        seq_printf(m, "compressions: %llu\ncompress_ns: %llu\n", sum->compressions, sum->compress_ns);
+        seq_printf(m, "decompressions: %llu\ndecompress_ns: %llu\n",
+                   sum->decompressions, sum->decompress_ns);
+    }
+    // A CPU belongs to one node, so summing its counters per node gives
+    // the hits and misses of each node's submitters.
+    seq_printf(m, "numa_policy: %s\n", sbd_numa_policies[sbd_numa]);
+    for_each_online_node(node) {
+        u64 hits = 0, misses = 0;
+
+        for_each_possible_cpu(cpu) {
+            if (cpu_to_node(cpu) != node)
+                continue;
+            stats = per_cpu_ptr(dev->stats, cpu);
+            hits += stats->numa_hits;
+            misses += stats->numa_misses;
+        }
+        seq_printf(m, "node%d_hits: %llu\nnode%d_misses: %llu\n", node, hits, node, misses);
+    }
+    sbd_show_hist(m, "segments per request", sum->segments);
+    sbd_show_hist(m, "request bytes", sum->sizes);
+    sbd_show_hist(m, "read latency ns", sum->latency[READ]);
+    sbd_show_hist(m, "write latency ns", sum->latency[WRITE]);
+
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int reset_set(void *data, u64 val) {
+    struct sbd_struct *dev = data;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct sbd_stats));
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(reset_fops, NULL, reset_set, "%llu\n");
+
+static int enable_get(void *data, u64 *val) {
+    *val = static_key_enabled(&sbd_stats_enabled);
+    return 0;
+}
+
+static int enable_set(void *data, u64 val) {
+    if (val)
+        static_branch_enable(&sbd_stats_enabled);
+    else
+        static_branch_disable(&sbd_stats_enabled);
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(enable_fops, enable_get, enable_set, "%llu\n");
+
+static void sbd_debugfs_init(struct sbd_struct *dev) {
+    dev->debugfs = debugfs_create_dir(dev->gd->disk_name, sbd_debugfs);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &stats_fops);
+    debugfs_create_file_unsafe("reset", 0200, dev->debugfs, dev, &reset_fops);
+}
+
+struct sbd_stress_thread {
+    struct sbd_struct *dev;
+    struct task_struct *task;
+    u32 *buffer;
+    u32 id;
+    unsigned int window; // Bytes per request
+    unsigned int offset; // Of each window from its stride
+    u64 ops;
+    u64 torn;
+    u64 errors;
+};
+
+// Sends one window through the queue like any other request, so the check
+// covers queue_request() and transfer_request() as well as the locks.
+static int sbd_stress_rq(struct sbd_stress_thread *t, sector_t sector, bool write) {
+    struct request_queue *q = t->dev->gd->queue;
+    struct request *rq;
+    int ret;
+
+    rq = blk_mq_alloc_request(q, write ? REQ_OP_WRITE : REQ_OP_READ, 0);
+    if (IS_ERR(rq))
+        return PTR_ERR(rq);
+    ret = blk_rq_map_kern(q, rq, t->buffer, t->window, GFP_KERNEL);
+    if (!ret) {
+        rq->__sector = sector;
+        ret = blk_status_to_errno(blk_execute_rq(t->dev->gd, rq, 0));
+    }
+    blk_mq_free_request(rq);
+    return ret;
+}
+
+// Writers stamp a whole window with one word and readers check that every
+// window they read back carries a single stamp. Windows straddle at least
+// one 64 KiB boundary so a request spans more than one stripe.
+static int sbd_stress_fn(void *data) {
+    struct sbd_stress_thread *t = data;
+    unsigned int words = t->window / sizeof(u32);
+    unsigned int i, seq = 0;
+    sector_t sector;
+
+    while (!kthread_should_stop()) {
+        sector = (prandom_u32_max(SBD_STRESS_WINDOWS) * SBD_STRESS_WINDOW_STRIDE +
+                  t->offset) >> SECTOR_SHIFT;
+        if (prandom_u32_max(2)) {
+            memset32(t->buffer, (t->id << 24) | (++seq & 0xffffff), words);
+            if (sbd_stress_rq(t, sector, true))
+                t->errors++;
+        } else if (sbd_stress_rq(t, sector, false)) {
+            t->errors++;
+        } else {
+            for (i = 1; i < words; i++) {
+                if (t->buffer[i] != t->buffer[0]) {
+                    t->torn++;
+                    break;
+                }
+            }
+        }
+        t->ops++;
+        cond_resched();
+    }
+    return 0;
+}
+
+// Runs on the live queue before the disk is registered, so only the stress
+// threads send it requests; the pages they leave behind and the statistics
+// they add are dropped afterwards.
+static int sbd_stress(struct sbd_struct *dev, unsigned int index) {
+    struct request_queue *q = dev->gd->queue;
+    unsigned int lbs = queue_logical_block_size(q);
+    struct sbd_stress_thread *threads;
+    unsigned int nr = 0, cpu, i, window, offset;
+    u64 ops = 0, torn = 0, errors = 0;
+    int ret = 0;
+
+    if (((u64)size_mb << 20) < SBD_STRESS_WINDOWS * SBD_STRESS_WINDOW_STRIDE) {
+        pr_notice("[sbd] Device %u is too small for the stress check.\n", index);
+        return 0;
+    }
+
+    // A window has to fit in one request, so it shrinks on queues with a
+    // low max_hw_sectors or few segments; a short window moves up so it
+    // still crosses the first stripe boundary.
+    window = min3((unsigned int)SBD_STRESS_WINDOW_SIZE,
+                  queue_max_hw_sectors(q) << SECTOR_SHIFT,
+                  queue_max_segments(q) << PAGE_SHIFT);
+    window = round_down(window, lbs);
+    offset = round_down(max_t(unsigned int, SBD_STRESS_WINDOW_OFFSET,
+                              (1U << (SBD_STRIPE_SHIFT + SECTOR_SHIFT)) - window / 2), lbs);
+
+    threads = kcalloc(num_online_cpus(), sizeof(*threads), GFP_KERNEL);
+    if (!threads)
         return -ENOMEM;
+
+    for_each_online_cpu(cpu) {
+        struct sbd_stress_thread *t = &threads[nr];
+
+        if (nr == num_online_cpus())
+            break;
+        t->dev = dev;
+        t->id = nr;
+        t->window = window;
+        t->offset = offset;
+        t->buffer = vmalloc(window);
+        if (!t->buffer) {
+            ret = -ENOMEM;
+            break;
+        }
+        t->task = kthread_create(sbd_stress_fn, t, "sbd_stress/%u", cpu);
+        if (IS_ERR(t->task)) {
+            ret = PTR_ERR(t->task);
+            vfree(t->buffer);
+            break;
+        }
+        kthread_bind(t->task, cpu);
+        wake_up_process(t->task);
+        nr++;
     }
 
-    major = register_blkdev(major, "sbd");
-    if (major <= 0) {
-        pr_alert("Major number allocation error!\n");
-        put_disk(sbd_dev.gd);
-        vfree(sbd_dev.memory);
+    if (!ret)
+        msleep(stress_seconds * MSEC_PER_SEC);
+
+    for (i = 0; i < nr; i++) {
+        kthread_stop(threads[i].task);
+        vfree(threads[i].buffer);
+        ops += threads[i].ops;
+        torn += threads[i].torn;
+        errors += threads[i].errors;
+    }
+    kfree(threads);
+    sbd_free_pages(dev);
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct sbd_stats));
+
+    if (ret)
+        return ret;
+    pr_info("[sbd] Stress check on device %u: %u threads, %llu requests, %llu torn, %llu failed.\n",
+            index, nr, ops, torn, errors);
+    return torn || errors ? -EIO : 0;
+}
+
+static void sbd_set_limits(struct sbd_struct *dev) {
+    struct request_queue *q = dev->gd->queue;
+
+    blk_queue_logical_block_size(q, logical_block_size);
+    blk_queue_physical_block_size(q, physical_block_size);
+    if (max_hw_sectors)
+        blk_queue_max_hw_sectors(q, max_hw_sectors);
+    if (max_segments)
+        blk_queue_max_segments(q, max_segments);
+    if (io_min)
+        blk_queue_io_min(q, io_min);
+    if (io_opt)
+        blk_queue_io_opt(q, io_opt);
+
+    if (rotational) {
+        blk_queue_flag_clear(QUEUE_FLAG_NONROT, q);
+    } else {
+        blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+        blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+    }
+
+    blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+    q->limits.discard_granularity = PAGE_SIZE;
+    blk_queue_max_discard_sectors(q, UINT_MAX >> 9);
+    blk_queue_max_write_zeroes_sectors(q, UINT_MAX >> 9);
+
+    // Writes are only durable once a flush has pushed them to the file.
+    if (dev->file)
+        blk_queue_write_cache(q, true, false);
+}
+
+static int sbd_open_backing(struct sbd_struct *dev, unsigned int index) {
+    char *path;
+    int ret;
+
+    if (nr_devices == 1)
+        path = kstrdup(backing_file, GFP_KERNEL);
+    else
+        path = kasprintf(GFP_KERNEL, "%s.%u", backing_file, index);
+    if (!path)
         return -ENOMEM;
+    dev->file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    kfree(path);
+    if (IS_ERR(dev->file)) {
+        ret = PTR_ERR(dev->file);
+        dev->file = NULL;
+        return ret;
+    }
+    if (!S_ISREG(file_inode(dev->file)->i_mode)) {
+        ret = -EINVAL;
+        goto ber1;
     }
 
-    pr_info("[sbd] Major number allocated: %d.\n", major);
-    sbd_dev.gd->major = major;
-    sbd_dev.gd->first_minor = 0;
-    sbd_dev.gd->fops = &block_methods;
-    sbd_dev.gd->private_data = NULL;
-    sbd_dev.gd->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
-    strcpy(sbd_dev.gd->disk_name, "sbd");
-    set_capacity(sbd_dev.gd, DEVICE_SIZE >> 9);
-    sbd_dev.gd->queue = blk_alloc_queue(GFP_KERNEL);
-    if (!sbd_dev.gd->queue) {
-        pr_alert("Request queue allocation error!\n");
-        unregister_blkdev(major, "sbd");
-        put_disk(sbd_dev.gd);
-        vfree(sbd_dev.memory);
+    dev->store_pages = size_mb << (20 - PAGE_SHIFT);
+    dev->loaded = kvzalloc(BITS_TO_LONGS(dev->store_pages) * sizeof(long), GFP_KERNEL);
+    dev->dirty = kvzalloc(BITS_TO_LONGS(dev->store_pages) * sizeof(long), GFP_KERNEL);
+    dev->wb_bvec = kcalloc(SBD_WB_BATCH, sizeof(*dev->wb_bvec), GFP_KERNEL);
+    if (!dev->loaded || !dev->dirty || !dev->wb_bvec) {
+        ret = -ENOMEM;
+        goto ber2;
+    }
+    // A new file has nothing to fault in.
+    if (!i_size_read(file_inode(dev->file)))
+        bitmap_fill(dev->loaded, dev->store_pages);
+
+    mutex_init(&dev->wb_mutex);
+    INIT_DELAYED_WORK(&dev->wb_work, sbd_writeback_work);
+    return 0;
+
+ber2:
+    kvfree(dev->loaded);
+    kvfree(dev->dirty);
+    kfree(dev->wb_bvec);
+ber1:
+    filp_close(dev->file, NULL);
+    dev->file = NULL;
+    return ret;
+}
+
+// Stops background writeback and pushes out whatever is still dirty. The
+// queue must already be gone so nothing dirties pages behind us.
+static void sbd_close_backing(struct sbd_struct *dev) {
+    if (!dev->file)
+        return;
+    cancel_delayed_work_sync(&dev->wb_work);
+    if (sbd_checkpoint(dev))
+        pr_alert("Final writeback to the backing file failed, its contents are stale!\n");
+    filp_close(dev->file, NULL);
+    dev->file = NULL;
+    kvfree(dev->loaded);
+    kvfree(dev->dirty);
+    kfree(dev->wb_bvec);
+}
+
+static int sbd_alloc_device(struct sbd_struct *dev, unsigned int index) {
+    char pool_name[16];
+    unsigned int i;
+    int ret;
+
+    // Snapshots come with their top layer already stacked on the origin's.
+    if (!dev->top)
+        dev->top = sbd_alloc_layer(NULL);
+    if (!dev->top) {
+        pr_alert("Page map allocation error!\n");
+        return -ENOMEM;
+    }
+
+    dev->stats = alloc_percpu(struct sbd_stats);
+    if (!dev->stats) {
+        pr_alert("Statistics allocation error!\n");
+        return -ENOMEM;
+    }
+
+    ret = sbd_alloc_stripes(dev);
+    if (ret) {
+        pr_alert("Range lock allocation error!\n");
+        goto aer1;
+    }
+
+    if (compress[0]) {
+        snprintf(pool_name, sizeof(pool_name), "sbd%u", index);
+        dev->zpool = zs_create_pool(pool_name);
+        if (!dev->zpool) {
+            pr_alert("Compressed pool allocation error!\n");
+            ret = -ENOMEM;
+            goto aer2;
+        }
+    }
+
+    if (backing_file[0]) {
+        ret = sbd_open_backing(dev, index);
+        if (ret) {
+            pr_alert("Backing file open error!\n");
+            goto aer3;
+        }
+    }
+
+    // One hardware queue per CPU unless told otherwise, so submitters
+    // never contend on a shared dispatch path. Queues are marked blocking
+    // because backing pages are allocated with GFP_NOIO on first write.
+    dev->tag_set.ops = &sbd_mq_ops;
+    dev->tag_set.nr_hw_queues = (hw_queues ? hw_queues : nr_cpu_ids) + poll_queues;
+    dev->tag_set.nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+    dev->tag_set.queue_depth = queue_depth;
+    // Bound devices keep their tags and request PDUs next to their pages.
+    dev->tag_set.numa_node = sbd_numa == SBD_NUMA_BIND ? numa_node : NUMA_NO_NODE;
+    dev->tag_set.cmd_size = sizeof(struct sbd_cmd);
+    dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+    dev->tag_set.driver_data = dev;
+
+    dev->poll = kcalloc(dev->tag_set.nr_hw_queues, sizeof(*dev->poll), GFP_KERNEL);
+    if (!dev->poll) {
+        pr_alert("Poll queue allocation error!\n");
+        ret = -ENOMEM;
+        goto aer4;
+    }
+    for (i = 0; i < dev->tag_set.nr_hw_queues; i++) {
+        spin_lock_init(&dev->poll[i].lock);
+        INIT_LIST_HEAD(&dev->poll[i].done);
+    }
+
+    ret = blk_mq_alloc_tag_set(&dev->tag_set);
+    if (ret) {
+        pr_alert("Tag set allocation error!\n");
+        goto aer5;
+    }
+
+    dev->gd = blk_mq_alloc_disk(&dev->tag_set, dev);
+    if (IS_ERR(dev->gd)) {
+        pr_alert("General disk structure allocation error!\n");
+        ret = PTR_ERR(dev->gd);
+        goto aer6;
+    }
+
+    dev->gd->major = major;
+    dev->gd->first_minor = index;
+    dev->gd->minors = 1;
+    dev->gd->fops = &block_methods;
+    dev->gd->private_data = dev;
+    dev->gd->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
+    if (nr_devices == 1 && !index)
+        strcpy(dev->gd->disk_name, name);
+    else
+        snprintf(dev->gd->disk_name, DISK_NAME_LEN, "%s%u", name, index);
+    set_capacity(dev->gd, size_mb << (20 - SECTOR_SHIFT));
+    set_disk_ro(dev->gd, dev->read_only);
+    sbd_set_limits(dev);
+
+    if (stress_seconds && !dev->top->parent) {
+        ret = sbd_stress(dev, index);
+        if (ret) {
+            pr_alert("Stress check failed!\n");
+            goto aer7;
+        }
+    }
+
+    ret = add_disk(dev->gd);
+    if (ret) {
+        pr_alert("Disk registration error!\n");
+        goto aer7;
+    }
+    sbd_debugfs_init(dev);
+    if (dev->file && writeback_ms)
+        queue_delayed_work(system_unbound_wq, &dev->wb_work, msecs_to_jiffies(writeback_ms));
+    pr_info("[sbd] %s: %lu MiB, %u byte blocks, %u hardware queues, %u polled.\n",
+            dev->gd->disk_name, size_mb, logical_block_size, dev->tag_set.nr_hw_queues, poll_queues);
+    return 0;
+
+aer7:
+    blk_cleanup_disk(dev->gd);
+aer6:
+    blk_mq_free_tag_set(&dev->tag_set);
+aer5:
+    kfree(dev->poll);
+aer4:
+    sbd_close_backing(dev);
+aer3:
+    if (dev->zpool)
+        zs_destroy_pool(dev->zpool);
+    dev->zpool = NULL;
+aer2:
+    kfree(dev->stripes);
+aer1:
+    free_percpu(dev->stats);
+    return ret;
+}
+
+static void sbd_free_device(struct sbd_struct *dev) {
+    debugfs_remove_recursive(dev->debugfs);
+    del_gendisk(dev->gd);
+    blk_cleanup_disk(dev->gd);
+    blk_mq_free_tag_set(&dev->tag_set);
+    kfree(dev->poll);
+    sbd_close_backing(dev);
+    free_percpu(dev->stats);
+    kfree(dev->stripes);
+}
+
+static bool __init sbd_check_params(void) {
+    int ret;
+
+    if (!nr_devices || nr_devices > MINORMASK + 1) {
+        pr_alert("nr_devices must be between 1 and %u!\n", MINORMASK + 1);
+        return false;
+    }
+    if (!size_mb) {
+        pr_alert("size_mb must not be zero!\n");
+        return false;
+    }
+    if (!is_power_of_2(logical_block_size) || logical_block_size < SECTOR_SIZE ||
+        logical_block_size > PAGE_SIZE) {
+        pr_alert("logical_block_size must be a power of two between %u and %lu!\n",
+                 SECTOR_SIZE, PAGE_SIZE);
+        return false;
+    }
+    if (!physical_block_size)
+        physical_block_size = logical_block_size;
+    if (!is_power_of_2(physical_block_size) || physical_block_size < logical_block_size) {
+        pr_alert("physical_block_size must be a power of two no smaller than the logical one!\n");
+        return false;
+    }
+    ret = match_string(sbd_numa_policies, ARRAY_SIZE(sbd_numa_policies), numa_policy);
+    if (ret < 0) {
+        pr_alert("numa_policy must be local, interleave or bind!\n");
+        return false;
+    }
+    sbd_numa = ret;
+    if (sbd_numa == SBD_NUMA_BIND && (numa_node < 0 || numa_node >= MAX_NUMNODES ||
+                                      !node_online(numa_node))) {
+        pr_alert("numa_node %d is not an online node!\n", numa_node);
+        return false;
+    }
+    if (poll_queues > nr_cpu_ids) {
+        pr_alert("poll_queues must not exceed the number of CPUs!\n");
+        return false;
+    }
+    if (!is_power_of_2(lock_stripes)) {
+        pr_alert("lock_stripes must be a power of two!\n");
+        return false;
+    }
+    if (max_hw_sectors && max_hw_sectors < (logical_block_size >> SECTOR_SHIFT)) {
+        pr_alert("max_hw_sectors must cover at least one logical block!\n");
+        return false;
+    }
+    if (compress[0] && !crypto_has_comp(compress, 0, 0)) {
+        pr_alert("Compression algorithm %s is not available!\n", compress);
+        return false;
+    }
+    // zsmalloc picks the pages behind compressed objects itself.
+    if (compress[0] && sbd_numa != SBD_NUMA_LOCAL) {
+        pr_alert("numa_policy has no effect on compressed pages, so compress needs numa_policy=local!\n");
+        return false;
+    }
+    if (backing_file[0] && compress[0]) {
+        pr_alert("backing_file only works with plain pages, not with compress!\n");
+        return false;
+    }
+    if (backing_file[0] && stress_seconds) {
+        pr_alert("The stress check would overwrite the backing file, so it cannot run with backing_file!\n");
+        return false;
+    }
+    return true;
+}
+
+static void sbd_zexit(void) {
+    struct sbd_zstream *zstrm;
+    int cpu;
+
+    if (sbd_zstreams) {
+        for_each_possible_cpu(cpu) {
+            zstrm = per_cpu_ptr(sbd_zstreams, cpu);
+            if (!IS_ERR_OR_NULL(zstrm->tfm))
+                crypto_free_comp(zstrm->tfm);
+            vfree(zstrm->buffer);
+            kfree(zstrm->scratch);
+        }
+        free_percpu(sbd_zstreams);
+        sbd_zstreams = NULL;
+    }
+    kmem_cache_destroy(sbd_zentry_cache);
+    sbd_zentry_cache = NULL;
+}
+
+static int __init sbd_zinit(void) {
+    struct sbd_zstream *zstrm;
+    int cpu;
+
+    sbd_zentry_cache = KMEM_CACHE(sbd_zentry, 0);
+    sbd_zstreams = alloc_percpu(struct sbd_zstream);
+    if (!sbd_zentry_cache || !sbd_zstreams)
+        goto zer1;
+
+    for_each_possible_cpu(cpu) {
+        zstrm = per_cpu_ptr(sbd_zstreams, cpu);
+        zstrm->tfm = crypto_alloc_comp(compress, 0, 0);
+        zstrm->buffer = vmalloc(2 * PAGE_SIZE);
+        zstrm->scratch = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if (IS_ERR_OR_NULL(zstrm->tfm) || !zstrm->buffer || !zstrm->scratch)
+            goto zer1;
+    }
+    return 0;
+
+zer1:
+    sbd_zexit();
+    return -ENOMEM;
+}
+
+static void sbd_free_store(struct sbd_struct *dev) {
+    if (!dev->top)
+        return;
+    sbd_free_pages(dev);
+    kref_put(&dev->top->ref, sbd_release_layer);
+    dev->top = NULL;
+    if (dev->zpool)
+        zs_destroy_pool(dev->zpool);
+    dev->zpool = NULL;
+}
+
+// Freeze the origin's top layer and stack a new empty layer over it for
+// both the origin and the snapshot. Nothing is copied, so this takes the
+// same time for any amount of data; pages are copied up on first write.
+static int sbd_snapshot(struct sbd_struct *origin, bool writable) {
+    struct sbd_layer *frozen, *top;
+    struct sbd_struct *dev;
+    int minor, ret;
+
+    if (compress[0] || backing_file[0])
+        return -EOPNOTSUPP;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
         return -ENOMEM;
+    minor = ida_alloc_range(&sbd_minors, nr_devices, MINORMASK, GFP_KERNEL);
+    if (minor < 0) {
+        ret = minor;
+        goto ser1;
+    }
+
+    mutex_lock(&sbd_snapshot_mutex);
+    frozen = origin->top;
+    top = sbd_alloc_layer(frozen);
+    dev->top = sbd_alloc_layer(frozen);
+    if (!top || !dev->top) {
+        if (top)
+            kref_put(&top->ref, sbd_release_layer);
+        if (dev->top)
+            kref_put(&dev->top->ref, sbd_release_layer);
+        ret = -ENOMEM;
+        goto ser2;
     }
 
-    blk_queue_make_request(sbd_dev.gd->queue, make_request);
-    pr_info("[sbd] Gendisk initialized.\n");
-    add_disk(sbd_dev.gd);
+    // No request may run while the origin's top layer changes hands.
+    blk_mq_freeze_queue(origin->gd->queue);
+    origin->top = top;
+    blk_mq_unfreeze_queue(origin->gd->queue);
+    // The origin's own reference; the two new layers keep it alive.
+    kref_put(&frozen->ref, sbd_release_layer);
+
+    dev->read_only = !writable;
+    ret = sbd_alloc_device(dev, minor);
+    if (ret) {
+        sbd_free_store(dev);
+        goto ser2;
+    }
+    list_add_tail(&dev->list, &sbd_snapshots);
+    mutex_unlock(&sbd_snapshot_mutex);
+    pr_info("[sbd] %s: %s snapshot of %s.\n", dev->gd->disk_name,
+            writable ? "Writable" : "Read-only", origin->gd->disk_name);
+    return minor;
+
+ser2:
+    mutex_unlock(&sbd_snapshot_mutex);
+    ida_free(&sbd_minors, minor);
+ser1:
+    kfree(dev);
+    return ret;
+}
+
+// The layer directly above frozen, which must be its only child.
+static struct sbd_layer *sbd_find_child(struct sbd_layer *frozen) {
+    struct sbd_layer *layer;
+    struct sbd_struct *dev;
+    unsigned int i;
+
+    for (i = 0; i < nr_devices; i++) {
+        for (layer = sbd_devs[i].top; layer; layer = layer->parent) {
+            if (layer->parent == frozen)
+                return layer;
+        }
+    }
+    list_for_each_entry(dev, &sbd_snapshots, list) {
+        for (layer = dev->top; layer; layer = layer->parent) {
+            if (layer->parent == frozen)
+                return layer;
+        }
+    }
+    return NULL;
+}
+
+static void sbd_freeze_all(bool freeze) {
+    struct sbd_struct *dev;
+    unsigned int i;
+
+    for (i = 0; i < nr_devices; i++) {
+        if (freeze)
+            blk_mq_freeze_queue(sbd_devs[i].gd->queue);
+        else
+            blk_mq_unfreeze_queue(sbd_devs[i].gd->queue);
+    }
+    list_for_each_entry(dev, &sbd_snapshots, list) {
+        if (freeze)
+            blk_mq_freeze_queue(dev->gd->queue);
+        else
+            blk_mq_unfreeze_queue(dev->gd->queue);
+    }
+}
+
+// Fold a frozen layer that only one layer still stacks on into that layer.
+// Pages the child has not overridden move up, and the child then skips the
+// frozen layer, which is freed with whatever the child did override. A
+// move that fails leaves both layers linked, which still reads the same.
+static void sbd_merge_layer(struct sbd_layer *frozen) {
+    struct sbd_layer *child = sbd_find_child(frozen);
+    unsigned long index;
+    void *entry, *old;
+
+    if (!child)
+        return;
+    sbd_freeze_all(true);
+    xa_for_each(&frozen->pages, index, entry) {
+        if (xa_load(&child->pages, index))
+            continue;
+        old = xa_store(&child->pages, index, entry, GFP_NOIO);
+        if (xa_is_err(old))
+            goto out;
+        xa_erase(&frozen->pages, index);
+        if (!xa_is_value(entry)) {
+            child->nr_pages++;
+            frozen->nr_pages--;
+        }
+    }
+    if (frozen->parent)
+        kref_get(&frozen->parent->ref);
+    child->parent = frozen->parent;
+    kref_put(&frozen->ref, sbd_release_layer);
+    // Over nothing, tombstones read the same as holes.
+    if (!child->parent) {
+        xa_for_each(&child->pages, index, entry) {
+            if (xa_is_value(entry))
+                xa_erase(&child->pages, index);
+        }
+    }
+out:
+    sbd_freeze_all(false);
+}
+
+// Remove a snapshot device and drop its layer. When that leaves the frozen
+// layer below with a single child, the two are merged, so devices do not
+// keep walking layers that no other device shares.
+static int sbd_delete_snapshot(unsigned long minor) {
+    struct sbd_struct *dev, *found = NULL;
+    struct sbd_layer *frozen;
+    int ret = 0;
+
+    mutex_lock(&sbd_snapshot_mutex);
+    list_for_each_entry(dev, &sbd_snapshots, list) {
+        if (dev->gd->first_minor == minor) {
+            found = dev;
+            break;
+        }
+    }
+    if (!found) {
+        mutex_unlock(&sbd_snapshot_mutex);
+        return -ENODEV;
+    }
+    spin_lock(&sbd_open_lock);
+    if (found->openers)
+        ret = -EBUSY;
+    else
+        found->deleting = true;
+    spin_unlock(&sbd_open_lock);
+    if (!ret)
+        list_del(&found->list);
+    mutex_unlock(&sbd_snapshot_mutex);
+    if (ret)
+        return ret;
+
+    // Removing the disk waits for debugfs readers, which may be waiting
+    // for the snapshot mutex themselves.
+    pr_info("[sbd] %s: Deleting snapshot.\n", found->gd->disk_name);
+    sbd_free_device(found);
+
+    mutex_lock(&sbd_snapshot_mutex);
+    frozen = found->top->parent;
+    kref_get(&frozen->ref);
+    sbd_free_store(found);
+    // Our reference and the remaining child's.
+    if (kref_read(&frozen->ref) == 2)
+        sbd_merge_layer(frozen);
+    kref_put(&frozen->ref, sbd_release_layer);
+    mutex_unlock(&sbd_snapshot_mutex);
+
+    ida_free(&sbd_minors, minor);
+    kfree(found);
+    return 0;
+}
+
+static int __init sbd_constructor(void) {
+    unsigned int i;
+    int ret;
+
+    if (!sbd_check_params())
+        return -EINVAL;
+
+    if (compress[0] && sbd_zinit()) {
+        pr_alert("Compression stream allocation error!\n");
+        return -ENOMEM;
+    }
+
+    sbd_devs = kcalloc(nr_devices, sizeof(*sbd_devs), GFP_KERNEL);
+    if (!sbd_devs) {
+        pr_alert("Memory allocation error!\n");
+        ret = -ENOMEM;
+        goto ier1;
+    }
+
+    major = register_blkdev(major, name);
+    if (major <= 0) {
+        pr_alert("Major number allocation error!\n");
+        ret = -ENOMEM;
+        goto ier2;
+    }
+    pr_info("[sbd] Major number allocated: %d.\n", major);
+
+    sbd_debugfs = debugfs_create_dir(name, NULL);
+    debugfs_create_file_unsafe("enable", 0600, sbd_debugfs, NULL, &enable_fops);
+
+    for (i = 0; i < nr_devices; i++) {
+        ret = sbd_alloc_device(&sbd_devs[i], i);
+        if (ret)
+            goto ier3;
+    }
     return 0;
+
+ier3:
+    while (i--)
+        sbd_free_device(&sbd_devs[i]);
+    debugfs_remove_recursive(sbd_debugfs);
+    unregister_blkdev(major, name);
+    rcu_barrier();
+    for (i = 0; i < nr_devices; i++)
+        sbd_free_store(&sbd_devs[i]);
+ier2:
+    kfree(sbd_devs);
+ier1:
+    sbd_zexit();
+    return ret;
 }
 
 static void __exit sbd_desctructor(void) {
-    del_gendisk(sbd_dev.gd);
-    blk_cleanup_queue(sbd_dev.gd->queue);
-    unregister_blkdev(major, "sbd");
-    put_disk(sbd_dev.gd);
-    vfree(sbd_dev.memory);
+    struct sbd_struct *dev, *next;
+    unsigned int i;
+
+    list_for_each_entry(dev, &sbd_snapshots, list)
+        sbd_free_device(dev);
+    for (i = 0; i < nr_devices; i++)
+        sbd_free_device(&sbd_devs[i]);
+    debugfs_remove_recursive(sbd_debugfs);
+    unregister_blkdev(major, name);
+
+    rcu_barrier();
+    list_for_each_entry_safe(dev, next, &sbd_snapshots, list) {
+        sbd_free_store(dev);
+        kfree(dev);
+    }
+    ida_destroy(&sbd_minors);
+    for (i = 0; i < nr_devices; i++) {
+        pr_info("[sbd] Releasing %lu backing pages of device %u.\n", sbd_devs[i].top->nr_pages, i);
+        sbd_free_store(&sbd_devs[i]);
+    }
+    kfree(sbd_devs);
+    sbd_zexit();
 }
 
 module_init(sbd_constructor);
@@ -4,157 +4,253 @@
 #include <linux/fs.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
-#define DEVICE_SIZE 4 * 1024 * 1024
+#define MAX_PARTITIONS 16
 
-static int sector_size = 512;
 static int major = 0;
-static struct sbd_struct {
+
+// Partition sizes in MiB; partition i starts where partition i - 1 ends.
+static unsigned int partitions[MAX_PARTITIONS] = { 2, 1, 1 };
+static int nr_partitions = 3;
+module_param_array(partitions, uint, &nr_partitions, 0444);
+MODULE_PARM_DESC(partitions, "Comma separated partition sizes in MiB (default: 2,1,1)");
+
+static unsigned int queue_depth = 64;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of tags per hardware queue (default: 64)");
+
+struct sbd_part_stats {
+    u64 ios[2];
+    u64 bytes[2];
+};
+
+struct sbd_partition {
     struct gendisk *gd;
-    struct gendisk *gd1; // New partition 1
-    struct gendisk *gd2; // New partition 2
+    struct blk_mq_tag_set tag_set; // Own tags so partitions never contend
+    size_t offset;
+    size_t size;
+    struct sbd_part_stats __percpu *stats;
+};
+
+static struct sbd_struct {
+    struct sbd_partition parts[MAX_PARTITIONS];
+    size_t size;
     void *memory;
+    struct dentry *debugfs;
 } sbd_dev;
 
-static inline int transfer_single_bio(struct bio *bio) {
-    struct bvec_iter iter;
+static inline int transfer_request(struct sbd_partition *part, struct request *rq) {
+    struct req_iterator iter;
     struct bio_vec vector;
-    sector_t sector = bio->bi_iter.bi_sector;
-    bool write = bio_data_dir(bio) == WRITE;
+    void *base = sbd_dev.memory + part->offset;
+    sector_t sector = blk_rq_pos(rq);
+    bool write = rq_data_dir(rq) == WRITE;
 
-    bio_for_each_segment(vector, bio, iter) {
+    rq_for_each_segment(vector, rq, iter) {
         unsigned int len = vector.bv_len;
-        void *addr = kmap(vector.bv_page);
+        void *addr = kmap_atomic(vector.bv_page);
         if (write)
-            memcpy(sbd_dev.memory + sector * sector_size, addr + vector.bv_offset, len);
+            memcpy(base + (sector << SECTOR_SHIFT), addr + vector.bv_offset, len);
         else
-            memcpy(addr + vector.bv_offset, sbd_dev.memory + sector * sector_size, len);
-        kunmap(addr);
-        sector += len >> 9;
+            memcpy(addr + vector.bv_offset, base + (sector << SECTOR_SHIFT), len);
+        kunmap_atomic(addr);
+        sector += len >> SECTOR_SHIFT;
     }
     return 0;
 }
 
-static blk_qc_t make_request(struct request_queue *q, struct bio *bio) {
-    int result = 0;
+static blk_status_t queue_request(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
+    struct sbd_partition *part = hctx->queue->queuedata;
+    struct request *rq = bd->rq;
+    struct sbd_part_stats *stats;
+    int dir = rq_data_dir(rq);
 
-    if (bio_end_sector(bio) > get_capacity(bio->bi_bdev->bd_disk))
-        goto mrerr0;
+    blk_mq_start_request(rq);
 
-    result = transfer_single_bio(bio);
-    if (unlikely(result != 0))
+    // Capacity is the partition length, so this also keeps I/O from
+    // spilling into the neighbouring partition.
+    if (blk_rq_pos(rq) + blk_rq_sectors(rq) > get_capacity(part->gd))
         goto mrerr0;
 
-    bio_endio(bio);
-    return BLK_QC_T_NONE;
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        if (unlikely(transfer_request(part, rq) != 0))
+            goto mrerr0;
+        break;
+    case REQ_OP_FLUSH:
+        break;
+    default:
+        blk_mq_end_request(rq, BLK_STS_NOTSUPP);
+        return BLK_STS_OK;
+    }
+
+    stats = get_cpu_ptr(part->stats);
+    stats->ios[dir]++;
+    stats->bytes[dir] += blk_rq_bytes(rq);
+    put_cpu_ptr(part->stats);
+
+    blk_mq_end_request(rq, BLK_STS_OK);
+    return BLK_STS_OK;
 mrerr0:
-    bio_io_error(bio);
-    return BLK_QC_T_NONE;
+    blk_mq_end_request(rq, BLK_STS_IOERR);
+    return BLK_STS_OK;
 }
 
+static const struct blk_mq_ops sbd_mq_ops = {
+    .queue_rq = queue_request,
+};
+
 static struct block_device_operations block_methods = {
     .owner = THIS_MODULE,
 };
 
+static int stats_show(struct seq_file *m, void *v) {
+    struct sbd_part_stats sum, *stats;
+    int i, cpu;
+
+    seq_printf(m, "%-8s %12s %12s %12s %12s %16s %16s\n", "name", "offset", "size",
+               "reads", "writes", "read_bytes", "write_bytes");
+    for (i = 0; i < nr_partitions; i++) {
+        memset(&sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu) {
+            stats = per_cpu_ptr(sbd_dev.parts[i].stats, cpu);
+            sum.ios[READ] += stats->ios[READ];
+            sum.ios[WRITE] += stats->ios[WRITE];
+            sum.bytes[READ] += stats->bytes[READ];
+            sum.bytes[WRITE] += stats->bytes[WRITE];
+        }
+        seq_printf(m, "%-8s %12zu %12zu %12llu %12llu %16llu %16llu\n",
+                   sbd_dev.parts[i].gd->disk_name, sbd_dev.parts[i].offset, sbd_dev.parts[i].size,
+                   sum.ios[READ], sum.ios[WRITE], sum.bytes[READ], sum.bytes[WRITE]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int sbd_alloc_partition(struct sbd_partition *part, int index) {
+    int ret = -ENOMEM;
+
+    part->stats = alloc_percpu(struct sbd_part_stats);
+    if (!part->stats) {
+        pr_alert("Partition %d statistics allocation error!\n", index);
+        goto per1;
+    }
+
+    part->tag_set.ops = &sbd_mq_ops;
+    part->tag_set.nr_hw_queues = nr_cpu_ids;
+    part->tag_set.queue_depth = queue_depth;
+    part->tag_set.numa_node = NUMA_NO_NODE;
+    part->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    part->tag_set.driver_data = part;
+    ret = blk_mq_alloc_tag_set(&part->tag_set);
+    if (ret) {
+        pr_alert("Partition %d tag set allocation error!\n", index);
+        goto per2;
+    }
+
+    part->gd = blk_mq_alloc_disk(&part->tag_set, part);
+    if (IS_ERR(part->gd)) {
+        pr_alert("Partition %d disk structure allocation error!\n", index);
+        ret = PTR_ERR(part->gd);
+        goto per3;
+    }
+
+    part->gd->major = major;
+    part->gd->first_minor = index;
+    part->gd->minors = 1;
+    part->gd->fops = &block_methods;
+    part->gd->private_data = part;
+    part->gd->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
+    snprintf(part->gd->disk_name, DISK_NAME_LEN, "sbd%d", index);
+    set_capacity(part->gd, part->size >> SECTOR_SHIFT);
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, part->gd->queue);
+
+    ret = add_disk(part->gd);
+    if (ret) {
+        pr_alert("Partition %d registration error!\n", index);
+        goto per4;
+    }
+    pr_info("[sbd] %s: offset %zu, size %zu.\n", part->gd->disk_name, part->offset, part->size);
+    return 0;
+
+per4:
+    blk_cleanup_disk(part->gd);
+per3:
+    blk_mq_free_tag_set(&part->tag_set);
+per2:
+    free_percpu(part->stats);
+per1:
+    return ret;
+}
+
+static void sbd_free_partition(struct sbd_partition *part) {
+    del_gendisk(part->gd);
+    blk_cleanup_disk(part->gd);
+    blk_mq_free_tag_set(&part->tag_set);
+    free_percpu(part->stats);
+}
+
 static int __init sbd_constructor(void) {
-    sbd_dev.memory = vmalloc(DEVICE_SIZE);
+    int ret = -ENOMEM;
+    int i;
+
+    // Lay the partitions out back to back over one backing region.
+    for (i = 0; i < nr_partitions; i++) {
+        if (!partitions[i]) {
+            pr_alert("Partition %d has zero size!\n", i);
+            return -EINVAL;
+        }
+        sbd_dev.parts[i].offset = sbd_dev.size;
+        sbd_dev.parts[i].size = (size_t)partitions[i] << 20;
+        sbd_dev.size += sbd_dev.parts[i].size;
+    }
+
+    sbd_dev.memory = vzalloc(sbd_dev.size);
     if (!sbd_dev.memory) {
         pr_alert("Memory allocation error!\n");
         goto ier1;
     }
-    
-    // Allocate main gendisk
-    sbd_dev.gd = alloc_disk(1);
-    if (!sbd_dev.gd) {
-        pr_alert("General disk structure allocation error!\n");
-        goto ier2;
-    }
-    
-    // Allocate partition 1 gendisk
-    sbd_dev.gd1 = alloc_disk(1);
-    if (!sbd_dev.gd1) {
-        pr_alert("Partition 1 disk structure allocation error!\n");
-        goto ier3;
-    }
-    
-    // Allocate partition 2 gendisk
-    sbd_dev.gd2 = alloc_disk(1);
-    if (!sbd_dev.gd2) {
-        pr_alert("Partition 2 disk structure allocation error!\n");
-        goto ier4;
-    }
-    
+
     major = register_blkdev(major, "sbd");
     if (major <= 0) {
         pr_alert("Major number allocation error!\n");
-        goto ier5;
+        goto ier2;
     }
     pr_info("[sbd] Major number allocated: %d.\n", major);
-    
-    // Main gendisk initialization
-    sbd_dev.gd->major = major;
-    sbd_dev.gd->first_minor = 0;
-    sbd_dev.gd->fops = &block_methods;
-    sbd_dev.gd->private_data = NULL;
-    sbd_dev.gd->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
-    strcpy(sbd_dev.gd->disk_name, "sbd");
-    set_capacity(sbd_dev.gd, (DEVICE_SIZE) >> 9);
-    sbd_dev.gd->queue = blk_alloc_queue(GFP_KERNEL);
-    if (!sbd_dev.gd->queue) {
-        pr_alert("Request queue allocation error!\n");
-        goto ier6;
+
+    for (i = 0; i < nr_partitions; i++) {
+        ret = sbd_alloc_partition(&sbd_dev.parts[i], i);
+        if (ret)
+            goto ier3;
     }
-    blk_queue_make_request(sbd_dev.gd->queue, make_request);
-    pr_info("[sbd] Gendisk initialized.\n");
-
-    // Partition 1 initialization
-    sbd_dev.gd1->major = major;
-    sbd_dev.gd1->first_minor = 1;
-    sbd_dev.gd1->fops = &block_methods;
-    sbd_dev.gd1->private_data = NULL;
-    sbd_dev.gd1->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
-    strcpy(sbd_dev.gd1->disk_name, "sbd1");
-    set_capacity(sbd_dev.gd1, (DEVICE_SIZE) >> 9);
-    sbd_dev.gd1->queue = sbd_dev.gd->queue; // Use the same queue as the main gendisk
-
-    // Partition 2 initialization
-    sbd_dev.gd2->major = major;
-    sbd_dev.gd2->first_minor = 2;
-    sbd_dev.gd2->fops = &block_methods;
-    sbd_dev.gd2->private_data = NULL;
-    sbd_dev.gd2->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO;
-    strcpy(sbd_dev.gd2->disk_name, "sbd2");
-    set_capacity(sbd_dev.gd2, (DEVICE_SIZE) >> 9);
-    sbd_dev.gd2->queue = sbd_dev.gd->queue; // Use the same queue as the main gendisk
-
-    add_disk(sbd_dev.gd);
-    add_disk(sbd_dev.gd1); // Add partition 1 gendisk
-    add_disk(sbd_dev.gd2); // Add partition 2 gendisk
+
+    sbd_dev.debugfs = debugfs_create_dir("sbd", NULL);
+    debugfs_create_file("stats", 0444, sbd_dev.debugfs, NULL, &stats_fops);
     return 0;
 
-ier6:
-    unregister_blkdev(major, "sbd");
-ier5:
-    put_disk(sbd_dev.gd2);
-ier4:
-    put_disk(sbd_dev.gd1);
 ier3:
-    put_disk(sbd_dev.gd);
+    while (i--)
+        sbd_free_partition(&sbd_dev.parts[i]);
+    unregister_blkdev(major, "sbd");
 ier2:
     vfree(sbd_dev.memory);
 ier1:
-    return -ENOMEM;
+    return ret;
 }
 
 static void __exit sbd_desctructor(void) {
-    del_gendisk(sbd_dev.gd2);
-    del_gendisk(sbd_dev.gd1);
-    del_gendisk(sbd_dev.gd);
-    blk_cleanup_queue(sbd_dev.gd->queue);
+    int i;
+
+    debugfs_remove_recursive(sbd_dev.debugfs);
+    for (i = nr_partitions - 1; i >= 0; i--)
+        sbd_free_partition(&sbd_dev.parts[i]);
     unregister_blkdev(major, "sbd");
-    put_disk(sbd_dev.gd2);
-    put_disk(sbd_dev.gd1);
-    put_disk(sbd_dev.gd);
     vfree(sbd_dev.memory);
 }
 
@@ -164,4 +260,4 @@ module_exit(sbd_desctructor);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Muhammed Yavuz Berk Sener");
 MODULE_DESCRIPTION("A pseudo block device.");
-MODULE_VERSION("1.0");
\ No newline at end of file
+MODULE_VERSION("1.0");
@@ -3,254 +3,494 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/cache.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #define NAME "pseudochar"
 
-static struct cdev next_cdev;
-static struct cdev prev_cdev;
-static dev_t next_dev;
-static dev_t prev_dev;
-static struct class *next_class;
-static struct class *prev_class;
-static struct device *next_device;
-static struct device *prev_device;
-static uint64_t next_number;
-static uint64_t prev_number;
-static DEFINE_MUTEX(next_mutex);
-static DEFINE_MUTEX(prev_mutex);
+// Reserve a block of numbers: the argument points to a u64 holding the
+// block size on entry and the first number of the block on return. The
+// block continues from there in the counter's direction, step apart.
+#define COUNTER_IOC_MAGIC 'n'
+#define COUNTER_IOC_RESERVE _IOWR(COUNTER_IOC_MAGIC, 1, __u64)
+
+// The live values sit in a page of their own that any counter device maps
+// read only, so monitors can sample them without syscalls. Each value has
+// its own cache line; counter i is at offset i * sizeof(struct counter_slot).
+// With leasing on they show how far the leases reach, not the last number
+// handed out.
+struct counter_slot {
+    atomic64_t value;
+} ____cacheline_aligned;
+
+#define MAX_COUNTERS (PAGE_SIZE / sizeof(struct counter_slot))
+
+static unsigned int nr_counters = 2;
+module_param(nr_counters, uint, 0444);
+MODULE_PARM_DESC(nr_counters, "Number of counter devices: nextdev, prevdev, then counter2 and on (default: 2)");
+
+static unsigned long long step[MAX_COUNTERS] = { [0 ... MAX_COUNTERS - 1] = 1 };
+module_param_array(step, ullong, NULL, 0444);
+MODULE_PARM_DESC(step, "Distance between consecutive numbers of each counter (default: 1)");
+
+static bool down[MAX_COUNTERS] = { [1] = true };
+module_param_array(down, bool, NULL, 0444);
+MODULE_PARM_DESC(down, "Whether each counter counts down (default: only prevdev)");
+
+static unsigned long long min_value[MAX_COUNTERS];
+module_param_array(min_value, ullong, NULL, 0444);
+MODULE_PARM_DESC(min_value, "Lowest number of each counter (default: 0)");
+
+static unsigned long long max_value[MAX_COUNTERS] = { [0 ... MAX_COUNTERS - 1] = U64_MAX };
+module_param_array(max_value, ullong, NULL, 0444);
+MODULE_PARM_DESC(max_value, "Highest number of each counter (default: 2^64 - 1)");
+
+static unsigned long long start[MAX_COUNTERS];
+static unsigned int nr_start;
+module_param_array(start, ullong, &nr_start, 0444);
+MODULE_PARM_DESC(start, "First number of each counter (default: max_value for counters that count down, except prevdev, min_value otherwise)");
+
+static unsigned int lease_size = 0;
+module_param(lease_size, uint, 0444);
+MODULE_PARM_DESC(lease_size, "Numbers each CPU leases from a counter at once, 0 to allocate from it directly (default: 0)");
+
+// A range of numbers a CPU took from a counter in one atomic operation and
+// hands out without touching the shared cache line. Writing a counter bumps
+// its epoch, which makes every CPU drop what is left of its lease.
+struct counter_lease {
+    uint64_t next;
+    uint64_t left;
+    unsigned int epoch;
+};
 
-// Forward declarations
-static int next_open(struct inode *inode, struct file *filp);
-static int prev_open(struct inode *inode, struct file *filp);
-static int next_release(struct inode *inode, struct file *filp);
-static int prev_release(struct inode *inode, struct file *filp);
-static ssize_t next_read(struct file *filp, char __user *buf, size_t len, loff_t *offset);
-static ssize_t prev_read(struct file *filp, char __user *buf, size_t len, loff_t *offset);
-static ssize_t next_write(struct file *filp, const char __user *buf, size_t len, loff_t *offset);
-static ssize_t prev_write(struct file *filp, const char __user *buf, size_t len, loff_t *offset);
-
-// File operations for nextdev
-static struct file_operations next_fops = {
-    .owner = THIS_MODULE,
-    .open = next_open,
-    .release = next_release,
-    .read = next_read,
-    .write = next_write,
+struct counter_stats {
+    uint64_t reads;
+    uint64_t reserves;
+    uint64_t reserved;
+    uint64_t exhausted;
+    uint64_t writes;
+    uint64_t refills;
+};
+
+// Everything a counter needs on its hot path, in a cache line block of its
+// own so counters used from different cores never share one. Only the slot
+// and, rarely, the epoch are written.
+struct counter {
+    atomic64_t *value;
+    uint64_t step;
+    uint64_t min;
+    uint64_t max;
+    bool down;
+    atomic_t epoch;
+    struct counter_lease __percpu *lease;
+    struct counter_stats __percpu *stats;
+    struct device *device;
+    char name[16];
+} ____cacheline_aligned;
+
+// Per open file: the number the file is currently reading out, so a short
+// read can be continued without allocating another one.
+struct counter_file {
+    struct counter *counter;
+    char num[24];
+    size_t len;
 };
 
-// File operations for prevdev
-static struct file_operations prev_fops = {
+static struct cdev counter_cdev;
+static dev_t counter_dev;
+static struct class *counter_class;
+static struct page *counter_page;
+static struct counter_slot *counter_slots;
+static struct counter *counters;
+static struct dentry *counter_debugfs;
+
+// Forward declarations
+static int counter_open(struct inode *inode, struct file *filp);
+static int counter_release(struct inode *inode, struct file *filp);
+static ssize_t counter_read(struct file *filp, char __user *buf, size_t len, loff_t *offset);
+static ssize_t counter_write(struct file *filp, const char __user *buf, size_t len, loff_t *offset);
+static long counter_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int counter_mmap(struct file *filp, struct vm_area_struct *vma);
+
+// File operations shared by all counter devices
+static struct file_operations counter_fops = {
     .owner = THIS_MODULE,
-    .open = prev_open,
-    .release = prev_release,
-    .read = prev_read,
-    .write = prev_write,
+    .open = counter_open,
+    .release = counter_release,
+    .read = counter_read,
+    .write = counter_write,
+    .unlocked_ioctl = counter_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = counter_mmap,
 };
 
-// Implementation of open function for nextdev
-static int next_open(struct inode *inode, struct file *filp)
+// Take up to want numbers in one atomic operation; with exact, all of them
+// or none. Returns how many were taken and the first one in *first.
+static uint64_t counter_take(struct counter *c, uint64_t want, bool exact, uint64_t *first)
 {
-    mutex_lock(&next_mutex);
-    return 0;
+    s64 old, new;
+    uint64_t avail, n;
+
+    // Unbounded upwards from 0: a plain add, wrapping like an unsigned
+    // counter. With a lower bound the wrap would hand out numbers below it.
+    if (!c->down && c->min == 0 && c->max == U64_MAX) {
+        *first = atomic64_add_return(want * c->step, c->value) - (want - 1) * c->step;
+        return want;
+    }
+
+    old = atomic64_read(c->value);
+    do {
+        // A value written outside the bounds leaves nothing to take.
+        if (c->down)
+            avail = (uint64_t)old >= c->min ? ((uint64_t)old - c->min) / c->step : 0;
+        else
+            avail = (uint64_t)old <= c->max ? (c->max - (uint64_t)old) / c->step : 0;
+        n = min(want, avail);
+        if (!n || (exact && n < want))
+            return 0;
+        new = c->down ? old - n * c->step : old + n * c->step;
+    } while (!atomic64_try_cmpxchg(c->value, &old, new));
+
+    *first = c->down ? old - c->step : old + c->step;
+    return n;
 }
 
-// Implementation of open function for prevdev
-static int prev_open(struct inode *inode, struct file *filp)
+// Take the next number, from this CPU's lease if leasing is on
+static bool counter_alloc(struct counter *c, uint64_t *number)
 {
-    mutex_lock(&prev_mutex);
-    return 0;
+    struct counter_lease *lease;
+    bool ret = true;
+
+    if (!lease_size)
+        return counter_take(c, 1, true, number);
+
+    lease = get_cpu_ptr(c->lease);
+    if (!lease->left || lease->epoch != atomic_read(&c->epoch)) {
+        lease->epoch = atomic_read(&c->epoch);
+        lease->left = counter_take(c, lease_size, false, &lease->next);
+        this_cpu_inc(c->stats->refills);
+    }
+    if (lease->left) {
+        *number = lease->next;
+        lease->next = c->down ? lease->next - c->step : lease->next + c->step;
+        lease->left--;
+    } else {
+        ret = false;
+    }
+    put_cpu_ptr(c->lease);
+
+    return ret;
 }
 
-// Implementation of release function for nextdev
-static int next_release(struct inode *inode, struct file *filp)
+// Implementation of open function for all counters
+static int counter_open(struct inode *inode, struct file *filp)
 {
-    mutex_unlock(&next_mutex);
+    struct counter_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->counter = &counters[iminor(inode)];
+    filp->private_data = file;
+
     return 0;
 }
 
-// Implementation of release function for prevdev
-static int prev_release(struct inode *inode, struct file *filp)
+// Implementation of release function for all counters
+static int counter_release(struct inode *inode, struct file *filp)
 {
-    mutex_unlock(&prev_mutex);
+    kfree(filp->private_data);
     return 0;
 }
 
-// Implementation of read function for nextdev
-static ssize_t next_read(struct file *filp, char __user *buf, size_t len, loff_t *offset)
+// Implementation of read function for all counters
+// A read from offset 0 allocates a number; reads past it finish the same one.
+static ssize_t counter_read(struct file *filp, char __user *buf, size_t len, loff_t *offset)
 {
-    uint64_t number = next_number + 1;
-    char num[20];
-    int ret;
+    struct counter_file *file = filp->private_data;
+    struct counter *c = file->counter;
+    uint64_t number;
+
+    if (*offset == 0) {
+        // If the counter has reached its bound, return an end-of-file (EOF) condition
+        if (!counter_alloc(c, &number)) {
+            this_cpu_inc(c->stats->exhausted);
+            return 0;
+        }
+        this_cpu_inc(c->stats->reads);
+        file->len = snprintf(file->num, sizeof(file->num), "%llu\n", number);
+    }
 
-    snprintf(num, sizeof(num), "%llu\n", number);
+    return simple_read_from_buffer(buf, len, offset, file->num, file->len);
+}
+
+// Implementation of write function for all counters
+static ssize_t counter_write(struct file *filp, const char __user *buf, size_t len, loff_t *offset)
+{
+    struct counter_file *file = filp->private_data;
+    struct counter *c = file->counter;
+    unsigned long long number;
+    char num[24];
+    int ret;
 
-    ret = simple_read_from_buffer(buf, len, offset, num, strlen(num));
-    if (ret > 0)
-        next_number++;
+    ret = simple_write_to_buffer(num, sizeof(num) - 1, offset, buf, len);
+    if (ret > 0) {
+        num[ret] = '\0';
+        if (kstrtoull(num, 10, &number) || number < c->min || number > c->max)
+            return -EINVAL;
+        atomic64_set(c->value, number);
+        atomic_inc(&c->epoch);
+        this_cpu_inc(c->stats->writes);
+    }
 
     return ret;
 }
 
-// Implementation of read function for prevdev
-// Implementation of read function for prevdev
-static ssize_t prev_read(struct file *filp, char __user *buf, size_t len, loff_t *offset)
+// Implementation of ioctl function for all counters
+// The block comes straight from the counter, bypassing any leases, so it is
+// contiguous and costs one atomic operation however large it is.
+static long counter_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    if (prev_number > 0) {
-        uint64_t number = prev_number - 1;
-        char num[20];
-        int ret;
+    struct counter_file *file = filp->private_data;
+    struct counter *c = file->counter;
+    u64 __user *argp = (u64 __user *)arg;
+    u64 count, first;
+
+    if (cmd != COUNTER_IOC_RESERVE)
+        return -ENOTTY;
+
+    if (get_user(count, argp))
+        return -EFAULT;
+    if (!count || count > U64_MAX / c->step)
+        return -EINVAL;
+
+    if (!counter_take(c, count, true, &first)) {
+        this_cpu_inc(c->stats->exhausted);
+        return -ENOSPC;
+    }
+    this_cpu_inc(c->stats->reserves);
+    this_cpu_add(c->stats->reserved, count);
 
-        snprintf(num, sizeof(num), "%llu\n", number);
+    return put_user(first, argp);
+}
 
-        ret = simple_read_from_buffer(buf, len, offset, num, strlen(num));
-        if (ret > 0)
-            prev_number--;
+// Implementation of mmap function for all counters
+static int counter_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
 
-        return ret;
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    return vm_insert_page(vma, vma->vm_start, counter_page);
+}
+
+// Implementation of the debugfs statistics file of a counter
+static int counter_stats_show(struct seq_file *m, void *v)
+{
+    struct counter *c = m->private;
+    struct counter_stats sum = {}, *stats;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(c->stats, cpu);
+        sum.reads += stats->reads;
+        sum.reserves += stats->reserves;
+        sum.reserved += stats->reserved;
+        sum.exhausted += stats->exhausted;
+        sum.writes += stats->writes;
+        sum.refills += stats->refills;
     }
 
-    // If prev_number is already zero, return an end-of-file (EOF) condition
+    seq_printf(m, "value: %llu\n", (uint64_t)atomic64_read(c->value));
+    seq_printf(m, "step: %llu\ndirection: %s\n", c->step, c->down ? "down" : "up");
+    seq_printf(m, "min: %llu\nmax: %llu\n", c->min, c->max);
+    seq_printf(m, "reads: %llu\n", sum.reads);
+    seq_printf(m, "reserves: %llu\nreserved: %llu\n", sum.reserves, sum.reserved);
+    seq_printf(m, "exhausted: %llu\n", sum.exhausted);
+    seq_printf(m, "writes: %llu\n", sum.writes);
+    seq_printf(m, "lease_refills: %llu\n", sum.refills);
+
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(counter_stats);
 
+static void pseudochar_free_counters(void)
+{
+    unsigned int i;
 
-// Implementation of write function for nextdev
-static ssize_t next_write(struct file *filp, const char __user *buf, size_t len, loff_t *offset)
+    for (i = 0; i < nr_counters; i++) {
+        free_percpu(counters[i].lease);
+        free_percpu(counters[i].stats);
+    }
+    kfree(counters);
+    __free_page(counter_page);
+}
+
+static int __init pseudochar_alloc_counters(void)
 {
-    char num[20];
-    int ret;
+    struct counter *c;
+    unsigned int i;
+
+    counter_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!counter_page)
+        return -ENOMEM;
+    counter_slots = page_address(counter_page);
+
+    counters = kcalloc(nr_counters, sizeof(*counters), GFP_KERNEL);
+    if (!counters) {
+        __free_page(counter_page);
+        return -ENOMEM;
+    }
 
-    ret = simple_write_to_buffer(num, sizeof(num) - 1, offset, buf, len);
-    if (ret > 0) {
-        num[ret] = '\0';
-        kstrtoull(num, 10, &next_number);
+    for (i = 0; i < nr_counters; i++) {
+        c = &counters[i];
+        c->value = &counter_slots[i].value;
+        c->step = step[i];
+        c->down = down[i];
+        c->min = min_value[i];
+        c->max = max_value[i];
+        // prevdev has always started at its minimum and waited for a
+        // write; other counters counting down start at the top.
+        if (i < nr_start)
+            atomic64_set(c->value, start[i]);
+        else if (c->down && i != 1)
+            atomic64_set(c->value, c->max);
+        else
+            atomic64_set(c->value, c->min);
+        if (i == 0)
+            strscpy(c->name, "nextdev", sizeof(c->name));
+        else if (i == 1)
+            strscpy(c->name, "prevdev", sizeof(c->name));
+        else
+            snprintf(c->name, sizeof(c->name), "counter%u", i);
+
+        c->lease = alloc_percpu(struct counter_lease);
+        c->stats = alloc_percpu(struct counter_stats);
+        if (!c->lease || !c->stats) {
+            pseudochar_free_counters();
+            return -ENOMEM;
+        }
     }
 
-    return ret;
+    return 0;
 }
 
-// Implementation of write function for prevdev
-static ssize_t prev_write(struct file *filp, const char __user *buf, size_t len, loff_t *offset)
+static bool __init pseudochar_check_params(void)
 {
-    char num[20];
-    int ret;
+    unsigned int i;
 
-    ret = simple_write_to_buffer(num, sizeof(num) - 1, offset, buf, len);
-    if (ret > 0) {
-        num[ret] = '\0';
-        kstrtoull(num, 10, &prev_number);
+    if (!nr_counters || nr_counters > MAX_COUNTERS) {
+        printk(KERN_ALERT "[pseudochar]: nr_counters must be between 1 and %lu\n", MAX_COUNTERS);
+        return false;
     }
 
-    return ret;
+    for (i = 0; i < nr_counters; i++) {
+        if (!step[i] || min_value[i] > max_value[i]) {
+            printk(KERN_ALERT "[pseudochar]: Counter %u needs a nonzero step and min_value <= max_value\n", i);
+            return false;
+        }
+        if (i < nr_start && (start[i] < min_value[i] || start[i] > max_value[i])) {
+            printk(KERN_ALERT "[pseudochar]: Counter %u must start between min_value and max_value\n", i);
+            return false;
+        }
+    }
+
+    return true;
 }
 
 static int __init pseudochar_init(void)
 {
+    struct device *device;
+    unsigned int i;
     int ret;
 
-    // Allocate device numbers
-    ret = alloc_chrdev_region(&next_dev, 0, 1, "nextdev");
+    if (!pseudochar_check_params())
+        return -EINVAL;
+
+    ret = pseudochar_alloc_counters();
     if (ret < 0) {
-        printk(KERN_ALERT "[pseudochar]: Error allocating nextdev device number\n");
+        printk(KERN_ALERT "[pseudochar]: Error allocating counters\n");
         return ret;
     }
 
-    ret = alloc_chrdev_region(&prev_dev, 0, 1, "prevdev");
+    // Allocate device numbers
+    ret = alloc_chrdev_region(&counter_dev, 0, nr_counters, NAME);
     if (ret < 0) {
-        printk(KERN_ALERT "[pseudochar]: Error allocating prevdev device number\n");
-        unregister_chrdev_region(next_dev, 1);
-        return ret;
+        printk(KERN_ALERT "[pseudochar]: Error allocating device numbers\n");
+        goto per1;
     }
 
     // Create class
-    next_class = class_create(THIS_MODULE, "nextdev");
-    if (IS_ERR(next_class)) {
-        printk(KERN_ALERT "[pseudochar]: Error creating nextdev class\n");
-        unregister_chrdev_region(next_dev, 1);
-        unregister_chrdev_region(prev_dev, 1);
-        return PTR_ERR(next_class);
-    }
-
-    prev_class = class_create(THIS_MODULE, "prevdev");
-    if (IS_ERR(prev_class)) {
-        printk(KERN_ALERT "[pseudochar]: Error creating prevdev class\n");
-        class_destroy(next_class);
-        unregister_chrdev_region(next_dev, 1);
-        unregister_chrdev_region(prev_dev, 1);
-        return PTR_ERR(prev_class);
-    }
-
-    // Initialize character devices
-    cdev_init(&next_cdev, &next_fops);
-    ret = cdev_add(&next_cdev, next_dev, 1);
-    if (ret < 0) {
-        printk(KERN_ALERT "[pseudochar]: Error adding nextdev cdev\n");
-        class_destroy(next_class);
-        unregister_chrdev_region(next_dev, 1);
-        class_destroy(prev_class);
-        unregister_chrdev_region(prev_dev, 1);
-        return ret;
+    counter_class = class_create(THIS_MODULE, NAME);
+    if (IS_ERR(counter_class)) {
+        printk(KERN_ALERT "[pseudochar]: Error creating class\n");
+        ret = PTR_ERR(counter_class);
+        goto per2;
     }
 
-    cdev_init(&prev_cdev, &prev_fops);
-    ret = cdev_add(&prev_cdev, prev_dev, 1);
+    // Initialize the character device, one minor per counter
+    cdev_init(&counter_cdev, &counter_fops);
+    ret = cdev_add(&counter_cdev, counter_dev, nr_counters);
     if (ret < 0) {
-        printk(KERN_ALERT "[pseudochar]: Error adding prevdev cdev\n");
-        cdev_del(&next_cdev);
-        class_destroy(next_class);
-        unregister_chrdev_region(next_dev, 1);
-        class_destroy(prev_class);
-        unregister_chrdev_region(prev_dev, 1);
-        return ret;
+        printk(KERN_ALERT "[pseudochar]: Error adding cdev\n");
+        goto per3;
     }
 
     // Create devices
-    next_device = device_create(next_class, NULL, next_dev, NULL, "nextdev");
-    if (IS_ERR(next_device)) {
-        printk(KERN_ALERT "[pseudochar]: Error creating nextdev device\n");
-        cdev_del(&next_cdev);
-        class_destroy(next_class);
-        unregister_chrdev_region(next_dev, 1);
-        cdev_del(&prev_cdev);
-        class_destroy(prev_class);
-        unregister_chrdev_region(prev_dev, 1);
-        return PTR_ERR(next_device);
-    }
-
-    prev_device = device_create(prev_class, NULL, prev_dev, NULL, "prevdev");
-    if (IS_ERR(prev_device)) {
-        printk(KERN_ALERT "[pseudochar]: Error creating prevdev device\n");
-        device_destroy(next_class, next_dev);
-        cdev_del(&next_cdev);
-        class_destroy(next_class);
-        unregister_chrdev_region(next_dev, 1);
-        cdev_del(&prev_cdev);
-        class_destroy(prev_class);
-        unregister_chrdev_region(prev_dev, 1);
-        return PTR_ERR(prev_device);
+    counter_debugfs = debugfs_create_dir(NAME, NULL);
+    for (i = 0; i < nr_counters; i++) {
+        device = device_create(counter_class, NULL, MKDEV(MAJOR(counter_dev), i), NULL,
+                               "%s", counters[i].name);
+        if (IS_ERR(device)) {
+            printk(KERN_ALERT "[pseudochar]: Error creating %s device\n", counters[i].name);
+            ret = PTR_ERR(device);
+            goto per4;
+        }
+        counters[i].device = device;
+        debugfs_create_file(counters[i].name, 0444, counter_debugfs, &counters[i], &counter_stats_fops);
     }
 
     return 0;
+
+per4:
+    while (i--)
+        device_destroy(counter_class, MKDEV(MAJOR(counter_dev), i));
+    debugfs_remove_recursive(counter_debugfs);
+    cdev_del(&counter_cdev);
+per3:
+    class_destroy(counter_class);
+per2:
+    unregister_chrdev_region(counter_dev, nr_counters);
+per1:
+    pseudochar_free_counters();
+    return ret;
 }
 
 static void __exit pseudochar_exit(void)
 {
-    device_destroy(next_class, next_dev);
-    cdev_del(&next_cdev);
-    class_destroy(next_class);
-    unregister_chrdev_region(next_dev, 1);
-
-    device_destroy(prev_class, prev_dev);
-    cdev_del(&prev_cdev);
-    class_destroy(prev_class);
-    unregister_chrdev_region(prev_dev, 1);
+    unsigned int i;
+
+    debugfs_remove_recursive(counter_debugfs);
+    for (i = 0; i < nr_counters; i++)
+        device_destroy(counter_class, MKDEV(MAJOR(counter_dev), i));
+    cdev_del(&counter_cdev);
+    class_destroy(counter_class);
+    unregister_chrdev_region(counter_dev, nr_counters);
+
+    pseudochar_free_counters();
 }
 
 module_init(pseudochar_init);
 module_exit(pseudochar_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Muhammed Yavuz Berk Şener");
-MODULE_DESCRIPTION("Pseudo character device driver with nextdev and prevdev");
+MODULE_DESCRIPTION("Pseudo character device driver with table driven sequence counters");
 MODULE_VERSION("1.0");
-
-
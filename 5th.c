@@ -3,93 +3,517 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/sched/signal.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
 
 #define DEVICE_NAME "clipboard"
-#define MAX_BUFFER_SIZE 1024
+// How long a producer using the mapping may hold the sequence odd before
+// readers and writers give up with -EBUSY.
+#define CLIPBOARD_STALL_MS 1000
+
+static unsigned int max_size_mb = 16;
+module_param(max_size_mb, uint, 0444);
+MODULE_PARM_DESC(max_size_mb, "Largest the clipboard may grow, in MiB (default: 16)");
 
 static struct cdev clipboard_cdev;
 static dev_t clipboard_dev;
 static struct class *clipboard_class;
 static struct device *clipboard_device;
-static char clipboard_buffer[MAX_BUFFER_SIZE];
+// Serializes writers only; readers never take it.
 static DEFINE_MUTEX(clipboard_mutex);
 
-static int clipboard_open(struct inode *inode, struct file *filp)
+// The clipboard can be mapped: offset 0 is this header page, the contents
+// follow from the next page on. Whoever changes the contents makes the
+// sequence odd first and even again once done, so consumers that saw the
+// same even value before and after copying got a consistent snapshot.
+// Every producer, kernel or mapping, starts an update with a
+// compare-and-swap from an even value to the next odd one, and only the
+// producer that won it ends the update by storing the next even value.
+// Kernel writers additionally serialize on the mutex among themselves.
+// A writer publishes a new generation when it closes the file, after all
+// of its writes, or earlier with a zero length write(), which is also how
+// mapping producers publish theirs.
+struct clipboard_header {
+    u32 sequence;
+    u32 length; // Size of the contents
+    u32 generation;
+};
+
+// Per open file: the generation it last read to the end of, and whether it
+// changed the contents since it last published.
+struct clipboard_file {
+    u32 seen;
+    bool consumed;
+    bool dirty;
+};
+
+// Woken whenever a new generation is published.
+static DECLARE_WAIT_QUEUE_HEAD(clipboard_wait);
+
+static struct page *clipboard_header_page;
+static struct clipboard_header *clipboard_header;
+
+// The contents are a list of pages that only grows, up to max_size_mb.
+// Pages are never freed before unload, so a reader racing a writer at worst
+// copies stale data and retries.
+static struct page **clipboard_pages;
+static unsigned int clipboard_nr_pages;
+static unsigned int clipboard_max_pages;
+
+// Allocate contents pages so the first nr exist. Called with the mutex
+// held; the release pairs with the acquire in clipboard_read_iter().
+static int clipboard_grow(unsigned int nr)
 {
+    struct page *page;
+
+    while (clipboard_nr_pages < nr) {
+        page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!page)
+            return -ENOMEM;
+        clipboard_pages[clipboard_nr_pages] = page;
+        smp_store_release(&clipboard_nr_pages, clipboard_nr_pages + 1);
+    }
+
     return 0;
 }
 
-static int clipboard_release(struct inode *inode, struct file *filp)
+// The length as far as writers are concerned, clamped like readers do.
+static u32 clipboard_length(void)
+{
+    return min_t(u64, clipboard_header->length, (u64)clipboard_nr_pages << PAGE_SHIFT);
+}
+
+// Wait for an even sequence. A producer using the mapping that died in the
+// middle of an update leaves it odd for good, so this gives up after
+// CLIPBOARD_STALL_MS instead of spinning forever, backing off to short
+// sleeps once the update is clearly not a quick one.
+static int clipboard_wait_stable(u32 *seq)
 {
+    unsigned long timeout = jiffies + msecs_to_jiffies(CLIPBOARD_STALL_MS);
+    unsigned int spins = 0;
+
+    while ((*seq = READ_ONCE(clipboard_header->sequence)) & 1) {
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+        if (time_after(jiffies, timeout))
+            return -EBUSY;
+        if (++spins < 64)
+            cond_resched();
+        else
+            usleep_range(50, 100);
+    }
+
     return 0;
 }
 
-static ssize_t clipboard_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+// Called with the mutex held, so the only competitor is a producer using
+// the mapping.
+static int clipboard_begin_update(void)
 {
-    ssize_t bytes_read = 0;
+    u32 seq;
+    int ret;
 
-    mutex_lock(&clipboard_mutex);
+    do {
+        ret = clipboard_wait_stable(&seq);
+        if (ret)
+            return ret;
+    } while (cmpxchg(&clipboard_header->sequence, seq, seq + 1) != seq);
+    smp_wmb();
+
+    return 0;
+}
+
+// The sequence is odd and ours, so a plain store ends the update.
+static void clipboard_end_update(void)
+{
+    smp_wmb();
+    WRITE_ONCE(clipboard_header->sequence, clipboard_header->sequence + 1);
+}
+
+// Called with the mutex held; the caller wakes waiters once it is dropped.
+static void clipboard_publish(void)
+{
+    WRITE_ONCE(clipboard_header->generation, clipboard_header->generation + 1);
+}
+
+static void clipboard_wake(void)
+{
+    wake_up_interruptible_poll(&clipboard_wait, EPOLLIN | EPOLLRDNORM);
+}
 
-    if (*f_pos >= MAX_BUFFER_SIZE) {
+static int clipboard_open(struct inode *inode, struct file *filp)
+{
+    struct clipboard_file *file;
+    int ret;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    filp->private_data = file;
+
+    // Opening for writing with O_TRUNC starts new contents, which are
+    // published along with whatever the file writes next.
+    if ((filp->f_flags & O_TRUNC) && (filp->f_mode & FMODE_WRITE)) {
+        mutex_lock(&clipboard_mutex);
+        ret = clipboard_begin_update();
+        if (ret) {
+            mutex_unlock(&clipboard_mutex);
+            kfree(file);
+            return ret;
+        }
+        WRITE_ONCE(clipboard_header->length, 0);
+        clipboard_end_update();
         mutex_unlock(&clipboard_mutex);
-        return bytes_read; // End of file
+        file->dirty = true;
     }
 
-    if (*f_pos + count > MAX_BUFFER_SIZE)
-        count = MAX_BUFFER_SIZE - *f_pos;
+    return 0;
+}
+
+static int clipboard_release(struct inode *inode, struct file *filp)
+{
+    struct clipboard_file *file = filp->private_data;
 
-    if (copy_to_user(buf, &clipboard_buffer[*f_pos], count)) {
+    if (file->dirty) {
+        mutex_lock(&clipboard_mutex);
+        clipboard_publish();
         mutex_unlock(&clipboard_mutex);
+        clipboard_wake();
+    }
+    kfree(file);
+    return 0;
+}
+
+static bool clipboard_has_news(struct clipboard_file *file)
+{
+    return !file->consumed || READ_ONCE(clipboard_header->generation) != file->seen;
+}
+
+static int clipboard_read_begin(u32 *seq)
+{
+    int ret = clipboard_wait_stable(seq);
+
+    smp_rmb();
+    return ret;
+}
+
+static bool clipboard_read_retry(u32 seq)
+{
+    smp_rmb();
+    return READ_ONCE(clipboard_header->sequence) != seq;
+}
+
+// Also serves read() and splice()/sendfile() from the clipboard, through
+// generic_file_splice_read().
+//
+// Once a file has read the contents to the end, further reads wait for the
+// next generation, or fail with -EAGAIN on a non-blocking file, and then
+// start over from the beginning of the new contents.
+static ssize_t clipboard_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct clipboard_file *file = iocb->ki_filp->private_data;
+    size_t count, copied, chunk, offset, n;
+    unsigned int nr_pages;
+    u32 seq, length, generation;
+    loff_t pos;
+    int ret;
+
+    if (file->consumed) {
+        if (!clipboard_has_news(file)) {
+            if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+                return -EAGAIN;
+            if (wait_event_interruptible(clipboard_wait, clipboard_has_news(file)))
+                return -ERESTARTSYS;
+        }
+        file->consumed = false;
+        iocb->ki_pos = 0;
+    }
+    pos = iocb->ki_pos;
+
+    // Lock free: copy, and copy again if a writer changed the contents
+    // in the meantime. The bytes are always copied out of the page, never
+    // linked: splice() hands a pipe iterator, and copy_page_to_iter()
+    // would put the live page in the pipe, past the point of the check.
+    for (;;) {
+        ret = clipboard_read_begin(&seq);
+        if (ret)
+            return ret;
+
+        // The header is writable through the mapping, so never trust the
+        // length beyond the pages that exist.
+        generation = READ_ONCE(clipboard_header->generation);
+        nr_pages = smp_load_acquire(&clipboard_nr_pages);
+        length = min_t(u64, READ_ONCE(clipboard_header->length), (u64)nr_pages << PAGE_SHIFT);
+        count = pos < length ? min_t(size_t, iov_iter_count(to), length - pos) : 0;
+
+        for (copied = 0; copied < count; copied += n) {
+            offset = (pos + copied) & ~PAGE_MASK;
+            chunk = min_t(size_t, PAGE_SIZE - offset, count - copied);
+            n = copy_to_iter(page_address(clipboard_pages[(pos + copied) >> PAGE_SHIFT]) + offset,
+                            chunk, to);
+            if (n != chunk) {
+                copied += n;
+                break;
+            }
+        }
+
+        if (!clipboard_read_retry(seq))
+            break;
+        iov_iter_revert(to, copied);
+    }
+
+    if (count && !copied)
         return -EFAULT;
+
+    if (pos >= length) {
+        file->seen = generation;
+        file->consumed = true;
     }
 
-    *f_pos += count;
-    bytes_read = count;
+    iocb->ki_pos += copied;
 
-    mutex_unlock(&clipboard_mutex);
+    return copied;
+}
 
-    return bytes_read;
+static void clipboard_free_stage(struct page **stage, unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        if (stage[i])
+            __free_page(stage[i]);
+    }
+    kvfree(stage);
 }
 
-static ssize_t clipboard_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+// Also serves write() and splice() into the clipboard, through
+// iter_file_splice_write().
+//
+// The user buffer is copied into staging pages of its own before the mutex
+// is taken: faulting it in takes mmap_lock, which clipboard_fault() holds
+// while it takes the mutex, and the buffer may even be the clipboard's own
+// mapping. Staging also keeps a writer faulting on its buffer from holding
+// the sequence odd. The mutex is only held to copy the staged data over.
+static ssize_t clipboard_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    ssize_t bytes_written = 0;
+    struct clipboard_file *file = iocb->ki_filp->private_data;
+    bool append = iocb->ki_flags & IOCB_APPEND;
+    loff_t pos = iocb->ki_pos;
+    size_t count, copied, chunk, offset, n;
+    size_t max_size = (size_t)clipboard_max_pages << PAGE_SHIFT;
+    struct page **stage;
+    unsigned int nr_stage, i;
+    u32 length;
+    ssize_t ret;
+
+    if (!append && pos >= max_size)
+        return -ENOSPC;
+
+    // An empty write publishes the contents as they are, whether this file
+    // wrote them or a producer put them in through the mapping.
+    count = min_t(size_t, iov_iter_count(from), max_size - (append ? 0 : pos));
+    if (!count) {
+        mutex_lock(&clipboard_mutex);
+        clipboard_publish();
+        mutex_unlock(&clipboard_mutex);
+        clipboard_wake();
+        file->dirty = false;
+        return 0;
+    }
+
+    nr_stage = DIV_ROUND_UP(count, PAGE_SIZE);
+    stage = kvcalloc(nr_stage, sizeof(*stage), GFP_KERNEL);
+    if (!stage)
+        return -ENOMEM;
+    for (i = 0; i < nr_stage; i++) {
+        stage[i] = alloc_page(GFP_KERNEL);
+        if (!stage[i]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (copied = 0; copied < count; copied += n) {
+        chunk = min_t(size_t, PAGE_SIZE, count - copied);
+        n = copy_page_from_iter(stage[copied >> PAGE_SHIFT], 0, chunk, from);
+        if (n != chunk) {
+            copied += n;
+            break;
+        }
+    }
+    if (!copied) {
+        ret = -EFAULT;
+        goto out;
+    }
+    count = copied;
 
     mutex_lock(&clipboard_mutex);
 
-    if (*f_pos >= MAX_BUFFER_SIZE) {
-        mutex_unlock(&clipboard_mutex);
-        return bytes_written; // End of file
+    if (append) {
+        pos = clipboard_length();
+        if (pos >= max_size) {
+            ret = -ENOSPC;
+            goto revert;
+        }
+        if (count > max_size - pos) {
+            iov_iter_revert(from, count - (max_size - pos));
+            count = max_size - pos;
+        }
     }
 
-    if (*f_pos + count > MAX_BUFFER_SIZE)
-        count = MAX_BUFFER_SIZE - *f_pos;
+    ret = clipboard_grow((pos + count + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    if (ret)
+        goto revert;
+    ret = clipboard_begin_update();
+    if (ret)
+        goto revert;
+
+    // Writing past the end leaves a gap, which must read as zeroes and not
+    // as whatever an earlier, longer content left there.
+    length = clipboard_length();
+    while (length < pos) {
+        offset = length & ~PAGE_MASK;
+        chunk = min_t(size_t, PAGE_SIZE - offset, pos - length);
+        memset(page_address(clipboard_pages[length >> PAGE_SHIFT]) + offset, 0, chunk);
+        length += chunk;
+    }
 
-    if (copy_from_user(&clipboard_buffer[*f_pos], buf, count)) {
-        mutex_unlock(&clipboard_mutex);
-        return -EFAULT;
+    // Staged data starts at a page boundary, the destination at pos, so a
+    // chunk ends at whichever page boundary comes first.
+    for (copied = 0; copied < count; copied += chunk) {
+        offset = (pos + copied) & ~PAGE_MASK;
+        chunk = min_t(size_t, PAGE_SIZE - offset, PAGE_SIZE - (copied & ~PAGE_MASK));
+        chunk = min(chunk, count - copied);
+        memcpy(page_address(clipboard_pages[(pos + copied) >> PAGE_SHIFT]) + offset,
+               page_address(stage[copied >> PAGE_SHIFT]) + (copied & ~PAGE_MASK), chunk);
     }
 
-    *f_pos += count;
-    bytes_written = count;
+    if (pos + count > length)
+        WRITE_ONCE(clipboard_header->length, pos + count);
 
+    clipboard_end_update();
+
+    mutex_unlock(&clipboard_mutex);
+    file->dirty = true;
+
+    iocb->ki_pos = pos + count;
+    ret = count;
+    goto out;
+
+revert:
     mutex_unlock(&clipboard_mutex);
+    iov_iter_revert(from, count);
+out:
+    clipboard_free_stage(stage, nr_stage);
+
+    return ret;
+}
 
-    return bytes_written;
+// Page 0 of a mapping is the header, page n + 1 is contents page n.
+// Faulting past the current contents grows them, so producers can write
+// through the mapping up to max_size_mb. Taking the mutex under mmap_lock
+// is safe because writers never touch user memory while holding it.
+static vm_fault_t clipboard_fault(struct vm_fault *vmf)
+{
+    struct page *page = clipboard_header_page;
+    int ret;
+
+    if (vmf->pgoff) {
+        if (vmf->pgoff > clipboard_max_pages)
+            return VM_FAULT_SIGBUS;
+        mutex_lock(&clipboard_mutex);
+        ret = clipboard_grow(vmf->pgoff);
+        mutex_unlock(&clipboard_mutex);
+        if (ret)
+            return VM_FAULT_OOM;
+        page = clipboard_pages[vmf->pgoff - 1];
+    }
+
+    get_page(page);
+    vmf->page = page;
+
+    return 0;
+}
+
+static __poll_t clipboard_poll(struct file *filp, poll_table *wait)
+{
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &clipboard_wait, wait);
+    if (clipboard_has_news(filp->private_data))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
+static const struct vm_operations_struct clipboard_vm_ops = {
+    .fault = clipboard_fault,
+};
+
+// The pages stay allocated until the module is unloaded, which the
+// mapping's file reference prevents.
+static int clipboard_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (vma->vm_pgoff + vma_pages(vma) > (unsigned long)clipboard_max_pages + 1)
+        return -EINVAL;
+
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &clipboard_vm_ops;
+
+    return 0;
 }
 
 static struct file_operations clipboard_fops = {
     .owner = THIS_MODULE,
     .open = clipboard_open,
     .release = clipboard_release,
-    .read = clipboard_read,
-    .write = clipboard_write,
+    .read_iter = clipboard_read_iter,
+    .write_iter = clipboard_write_iter,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .mmap = clipboard_mmap,
+    .poll = clipboard_poll,
 };
 
+static void clipboard_free_pages(void)
+{
+    unsigned int i;
+
+    if (clipboard_header_page)
+        __free_page(clipboard_header_page);
+    for (i = 0; i < clipboard_nr_pages; i++)
+        __free_page(clipboard_pages[i]);
+    kvfree(clipboard_pages);
+}
+
 static int __init clipboard_init(void)
 {
+    if (!max_size_mb || max_size_mb >= 4096) {
+        printk(KERN_ALERT "max_size_mb must be between 1 and 4095\n");
+        return -EINVAL;
+    }
+    clipboard_max_pages = max_size_mb << (20 - PAGE_SHIFT);
+
+    clipboard_header_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    clipboard_pages = kvcalloc(clipboard_max_pages, sizeof(*clipboard_pages), GFP_KERNEL);
+    if (!clipboard_header_page || !clipboard_pages) {
+        printk(KERN_ALERT "Failed to allocate clipboard pages\n");
+        clipboard_free_pages();
+        return -ENOMEM;
+    }
+    clipboard_header = page_address(clipboard_header_page);
+
     if (alloc_chrdev_region(&clipboard_dev, 0, 1, DEVICE_NAME) < 0) {
         printk(KERN_ALERT "Failed to allocate device numbers\n");
+        clipboard_free_pages();
         return -1;
     }
 
@@ -98,6 +522,7 @@ static int __init clipboard_init(void)
     if (cdev_add(&clipboard_cdev, clipboard_dev, 1) < 0) {
         printk(KERN_ALERT "Failed to add character device\n");
         unregister_chrdev_region(clipboard_dev, 1);
+        clipboard_free_pages();
         return -1;
     }
 
@@ -106,6 +531,7 @@ static int __init clipboard_init(void)
         printk(KERN_ALERT "Failed to create device class\n");
         cdev_del(&clipboard_cdev);
         unregister_chrdev_region(clipboard_dev, 1);
+        clipboard_free_pages();
         return PTR_ERR(clipboard_class);
     }
 
@@ -115,6 +541,7 @@ static int __init clipboard_init(void)
         class_destroy(clipboard_class);
         cdev_del(&clipboard_cdev);
         unregister_chrdev_region(clipboard_dev, 1);
+        clipboard_free_pages();
         return PTR_ERR(clipboard_device);
     }
 
@@ -132,6 +559,7 @@ static void __exit clipboard_exit(void)
     class_destroy(clipboard_class);
     cdev_del(&clipboard_cdev);
     unregister_chrdev_region(clipboard_dev, 1);
+    clipboard_free_pages();
 
     printk(KERN_INFO "Clipboard device unloaded\n");
 }
@@ -0,0 +1,75 @@
+#ifndef BENCH_HIST_H
+#define BENCH_HIST_H
+
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+// Latency buckets shared by the benchmark modules: the power of two of the
+// value, split into eight linear steps, which keeps percentiles within 12.5%
+// of the real value.
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+static inline unsigned int hist_bucket(u64 value) {
+    unsigned int msb;
+
+    if (value < (1 << HIST_SUB_BITS))
+        return value;
+    msb = ilog2(value);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           ((value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Smallest value that falls into the bucket after the given one.
+static inline u64 hist_bucket_limit(unsigned int bucket) {
+    unsigned int shift = bucket >> HIST_SUB_BITS;
+    u64 sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+
+    if (!shift)
+        return sub + 1;
+    return ((1ULL << HIST_SUB_BITS) + sub + 1) << (shift - 1);
+}
+
+static inline u64 hist_percentile(const u64 *hist, u64 total, unsigned int permille) {
+    unsigned int b;
+    u64 seen = 0;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen * 1000 >= total * permille)
+            return hist_bucket_limit(b);
+    }
+    return 0;
+}
+
+// Prints "<name> <title> ns:" followed by the upper bounds of the median,
+// p90, p99, p99.9 and maximum buckets, or "-" for an empty histogram.
+static inline void show_percentiles(struct seq_file *m, const char *name, const char *title,
+                                    const u64 *hist, u64 total) {
+    static const unsigned int permille[] = { 500, 900, 990, 999 };
+    unsigned int p = 0, b;
+    u64 seen = 0;
+
+    seq_printf(m, "%s %s ns:", name, title);
+    if (!total) {
+        seq_puts(m, " -\n");
+        return;
+    }
+    for (b = 0; b < HIST_BUCKETS && p < ARRAY_SIZE(permille); b++) {
+        seen += hist[b];
+        while (p < ARRAY_SIZE(permille) && seen * 1000 >= total * permille[p]) {
+            seq_printf(m, " p%u.%u<%llu", permille[p] / 10, permille[p] % 10, hist_bucket_limit(b));
+            p++;
+        }
+    }
+    for (b = HIST_BUCKETS; b > 0; b--) {
+        if (hist[b - 1]) {
+            seq_printf(m, " max<%llu", hist_bucket_limit(b - 1));
+            break;
+        }
+    }
+    seq_putc(m, '\n');
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef BENCH_RUN_H
+#define BENCH_RUN_H
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+// Run control shared by the benchmark modules. Each module gets a debugfs
+// directory with a "start" and a "results" file. Writing "<n> [options]" to
+// start calls run() in the writer's context, so the write returns once the
+// run is over; a write while another run is going fails with -EBUSY. What
+// n and the options mean is up to the module, which also reads its
+// parameters in run(), so they can be changed between runs.
+struct bench_control {
+    const char *name;
+    u64 max; // Largest n run() accepts
+    int (*run)(u64 n, char *options); // options is "" if none were given
+    struct mutex lock;
+    struct dentry *debugfs;
+};
+
+static ssize_t bench_start_write(struct file *file, const char __user *buf, size_t count,
+                                 loff_t *ppos) {
+    struct bench_control *ctl = file->private_data;
+    char cmd[128], *options, *arg;
+    u64 n;
+    int ret;
+
+    if (count >= sizeof(cmd))
+        return -EINVAL;
+    if (copy_from_user(cmd, buf, count))
+        return -EFAULT;
+    cmd[count] = '\0';
+    options = strim(cmd);
+    arg = strsep(&options, " \t");
+    options = options ? skip_spaces(options) : "";
+    if (kstrtou64(arg, 0, &n) || !n || n > ctl->max)
+        return -EINVAL;
+
+    if (!mutex_trylock(&ctl->lock))
+        return -EBUSY;
+    ret = ctl->run(n, options);
+    mutex_unlock(&ctl->lock);
+    return ret ? ret : count;
+}
+
+static const struct file_operations bench_start_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = bench_start_write,
+    .llseek = no_llseek,
+};
+
+static inline void bench_control_init(struct bench_control *ctl,
+                                      const struct file_operations *results_fops) {
+    mutex_init(&ctl->lock);
+    ctl->debugfs = debugfs_create_dir(ctl->name, NULL);
+    debugfs_create_file("start", 0200, ctl->debugfs, ctl, &bench_start_fops);
+    debugfs_create_file("results", 0444, ctl->debugfs, NULL, results_fops);
+}
+
+static inline void bench_control_exit(struct bench_control *ctl) {
+    debugfs_remove_recursive(ctl->debugfs);
+}
+
+// For workers that are done before the run is: a kthread that returned on
+// its own may be gone by the time the run calls kthread_stop() on it.
+static inline void bench_wait_for_stop(void) {
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+}
+
+// Per-CPU statistics made of nothing but u64 counters, handled as arrays.
+// Summing during a run gives a snapshot, not a consistent total.
+static inline void bench_stats_reset(void __percpu *stats, size_t size) {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(stats, cpu), 0, size);
+}
+
+static inline void bench_stats_sum(u64 *sum, void __percpu *stats, size_t size) {
+    const u64 *src;
+    size_t i;
+    int cpu;
+
+    memset(sum, 0, size);
+    for_each_possible_cpu(cpu) {
+        src = per_cpu_ptr(stats, cpu);
+        for (i = 0; i < size / sizeof(u64); i++)
+            sum[i] += src[i];
+    }
+}
+
+#endif
@@ -0,0 +1,364 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/kthread.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/prandom.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+
+#include "bench_hist.h"
+#include "bench_run.h"
+
+#define MAX_THREADS 64
+
+static char path[128] = "/dev/sbd";
+module_param_string(path, path, sizeof(path), 0644);
+MODULE_PARM_DESC(path, "Block device to load (default: /dev/sbd)");
+
+static unsigned int threads = 1;
+module_param(threads, uint, 0644);
+MODULE_PARM_DESC(threads, "Number of submitting threads (default: 1)");
+
+static int cpus[MAX_THREADS];
+static int nr_cpus = 0;
+module_param_array(cpus, int, &nr_cpus, 0644);
+MODULE_PARM_DESC(cpus, "CPUs to bind thread i to, used round robin; unbound if empty");
+
+static unsigned int queue_depth = 32;
+module_param(queue_depth, uint, 0644);
+MODULE_PARM_DESC(queue_depth, "Bios in flight per thread (default: 32)");
+
+static unsigned int block_size = 4096;
+module_param(block_size, uint, 0644);
+MODULE_PARM_DESC(block_size, "Bytes per bio, a multiple of 512 (default: 4096)");
+
+static unsigned int read_percent = 100;
+module_param(read_percent, uint, 0644);
+MODULE_PARM_DESC(read_percent, "Share of reads in percent, the rest are writes (default: 100)");
+
+static bool random_io = true;
+module_param(random_io, bool, 0644);
+MODULE_PARM_DESC(random_io, "Random offsets instead of sequential per-thread streams (default: true)");
+
+struct bench_stats {
+    u64 ios[2];
+    u64 bytes[2];
+    u64 errors;
+    u64 latency[2][HIST_BUCKETS];
+};
+
+struct bench_worker;
+
+struct bench_slot {
+    struct llist_node node;
+    struct bench_worker *worker;
+    struct page **pages;
+    u64 start;
+};
+
+struct bench_worker {
+    struct task_struct *task;
+    struct bench_slot *slots;
+    struct llist_head free;
+    atomic_t inflight;
+    wait_queue_head_t wait;
+    sector_t cursor;
+    unsigned int index;
+};
+
+static struct bench_struct {
+    struct block_device *bdev;
+    struct bench_worker workers[MAX_THREADS];
+    struct bench_stats __percpu *stats;
+    unsigned int nr_workers;
+    unsigned int queue_depth;
+    unsigned int block_size;
+    unsigned int nr_pages;
+    sector_t nr_blocks;
+    unsigned long deadline;
+    u64 duration;
+} bench;
+
+static void bench_end_io(struct bio *bio) {
+    struct bench_slot *slot = bio->bi_private;
+    struct bench_worker *worker = slot->worker;
+    struct bench_stats *stats = get_cpu_ptr(bench.stats);
+    int dir = op_is_write(bio_op(bio)) ? WRITE : READ;
+
+    if (bio->bi_status) {
+        stats->errors++;
+    } else {
+        stats->ios[dir]++;
+        stats->bytes[dir] += bench.block_size;
+        stats->latency[dir][hist_bucket(ktime_get_ns() - slot->start)]++;
+    }
+    put_cpu_ptr(bench.stats);
+    bio_put(bio);
+
+    llist_add(&slot->node, &worker->free);
+    atomic_dec(&worker->inflight);
+    wake_up(&worker->wait);
+}
+
+static void bench_submit(struct bench_worker *worker, struct bench_slot *slot) {
+    struct bio *bio;
+    sector_t block;
+    unsigned int i;
+
+    if (random_io) {
+        block = prandom_u32_max(min_t(sector_t, bench.nr_blocks, U32_MAX));
+    } else {
+        block = worker->cursor;
+        if (++worker->cursor == bench.nr_blocks)
+            worker->cursor = 0;
+    }
+
+    bio = bio_alloc(GFP_KERNEL, bench.nr_pages);
+    bio_set_dev(bio, bench.bdev);
+    bio->bi_iter.bi_sector = block * (bench.block_size >> SECTOR_SHIFT);
+    bio->bi_opf = prandom_u32_max(100) < read_percent ? REQ_OP_READ : REQ_OP_WRITE;
+    bio->bi_end_io = bench_end_io;
+    bio->bi_private = slot;
+    for (i = 0; i < bench.nr_pages; i++)
+        bio_add_page(bio, slot->pages[i],
+                     min_t(unsigned int, PAGE_SIZE, bench.block_size - i * PAGE_SIZE), 0);
+
+    atomic_inc(&worker->inflight);
+    slot->start = ktime_get_ns();
+    submit_bio(bio);
+}
+
+// Keep queue_depth bios in flight until the deadline, then drain.
+static int bench_thread(void *data) {
+    struct bench_worker *worker = data;
+    struct llist_node *local = NULL;
+    struct bench_slot *slot;
+
+    while (!kthread_should_stop() && time_before(jiffies, bench.deadline)) {
+        if (!local)
+            local = llist_del_all(&worker->free);
+        if (!local) {
+            wait_event_timeout(worker->wait, !llist_empty(&worker->free), HZ / 10);
+            continue;
+        }
+        slot = llist_entry(local, struct bench_slot, node);
+        local = local->next;
+        bench_submit(worker, slot);
+        cond_resched();
+    }
+    wait_event(worker->wait, atomic_read(&worker->inflight) == 0);
+    bench_wait_for_stop();
+    return 0;
+}
+
+static void bench_free_worker(struct bench_worker *worker) {
+    unsigned int i, j;
+
+    if (!worker->slots)
+        return;
+    for (i = 0; i < bench.queue_depth; i++) {
+        if (!worker->slots[i].pages)
+            continue;
+        for (j = 0; j < bench.nr_pages; j++) {
+            if (worker->slots[i].pages[j])
+                __free_page(worker->slots[i].pages[j]);
+        }
+        kfree(worker->slots[i].pages);
+    }
+    kfree(worker->slots);
+    worker->slots = NULL;
+}
+
+static int bench_alloc_worker(struct bench_worker *worker, unsigned int index) {
+    struct bench_slot *slot;
+    unsigned int i, j;
+
+    worker->index = index;
+    worker->cursor = div_u64(bench.nr_blocks * index, bench.nr_workers);
+    init_llist_head(&worker->free);
+    atomic_set(&worker->inflight, 0);
+    init_waitqueue_head(&worker->wait);
+
+    worker->slots = kcalloc(bench.queue_depth, sizeof(*worker->slots), GFP_KERNEL);
+    if (!worker->slots)
+        return -ENOMEM;
+    for (i = 0; i < bench.queue_depth; i++) {
+        slot = &worker->slots[i];
+        slot->worker = worker;
+        slot->pages = kcalloc(bench.nr_pages, sizeof(*slot->pages), GFP_KERNEL);
+        if (!slot->pages)
+            goto wer1;
+        for (j = 0; j < bench.nr_pages; j++) {
+            slot->pages[j] = alloc_page(GFP_KERNEL);
+            if (!slot->pages[j])
+                goto wer1;
+            memset(page_address(slot->pages[j]), 0x5a + i, PAGE_SIZE);
+        }
+        llist_add(&slot->node, &worker->free);
+    }
+
+    worker->task = kthread_create(bench_thread, worker, "sbd_bench/%u", index);
+    if (IS_ERR(worker->task))
+        goto wer1;
+    if (nr_cpus)
+        kthread_bind(worker->task, cpus[index % nr_cpus]);
+    return 0;
+
+wer1:
+    worker->task = NULL;
+    bench_free_worker(worker);
+    return -ENOMEM;
+}
+
+static bool bench_check_params(void) {
+    int i;
+
+    if (!threads || threads > MAX_THREADS) {
+        pr_alert("[sbd_bench] threads must be between 1 and %d!\n", MAX_THREADS);
+        return false;
+    }
+    if (!queue_depth) {
+        pr_alert("[sbd_bench] queue_depth must not be zero!\n");
+        return false;
+    }
+    if (!block_size || block_size % SECTOR_SIZE || block_size > BIO_MAX_VECS * PAGE_SIZE) {
+        pr_alert("[sbd_bench] block_size must be a multiple of %u up to %lu!\n",
+                 SECTOR_SIZE, BIO_MAX_VECS * PAGE_SIZE);
+        return false;
+    }
+    if (read_percent > 100) {
+        pr_alert("[sbd_bench] read_percent must not exceed 100!\n");
+        return false;
+    }
+    for (i = 0; i < nr_cpus; i++) {
+        if (cpus[i] < 0 || cpus[i] >= nr_cpu_ids || !cpu_online(cpus[i])) {
+            pr_alert("[sbd_bench] CPU %d is not online!\n", cpus[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs for the number of seconds written to the start file.
+static int bench_run(u64 seconds, char *options) {
+    fmode_t mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+    unsigned int i;
+    u64 start;
+    int ret = 0;
+
+    if (*options || !bench_check_params())
+        return -EINVAL;
+
+    bench.bdev = blkdev_get_by_path(path, mode, &bench);
+    if (IS_ERR(bench.bdev)) {
+        pr_alert("[sbd_bench] Cannot open %s!\n", path);
+        ret = PTR_ERR(bench.bdev);
+        bench.bdev = NULL;
+        return ret;
+    }
+
+    bench.block_size = block_size;
+    bench.queue_depth = queue_depth;
+    bench.nr_blocks = div_u64(i_size_read(bench.bdev->bd_inode), bench.block_size);
+    if (!bench.nr_blocks) {
+        pr_alert("[sbd_bench] %s is smaller than one block!\n", path);
+        ret = -EINVAL;
+        goto rer1;
+    }
+    bench.nr_pages = DIV_ROUND_UP(bench.block_size, PAGE_SIZE);
+    bench.nr_workers = threads;
+    bench.deadline = jiffies + seconds * HZ;
+    bench_stats_reset(bench.stats, sizeof(struct bench_stats));
+
+    for (i = 0; i < bench.nr_workers; i++) {
+        ret = bench_alloc_worker(&bench.workers[i], i);
+        if (ret)
+            goto rer2;
+    }
+
+    start = ktime_get_ns();
+    for (i = 0; i < bench.nr_workers; i++)
+        wake_up_process(bench.workers[i].task);
+    msleep_interruptible(seconds * MSEC_PER_SEC);
+    for (i = 0; i < bench.nr_workers; i++)
+        kthread_stop(bench.workers[i].task);
+    bench.duration = ktime_get_ns() - start;
+    pr_info("[sbd_bench] Finished a %llu second run on %s.\n", seconds, path);
+
+    i = bench.nr_workers;
+rer2:
+    while (i--) {
+        if (ret && bench.workers[i].task)
+            kthread_stop(bench.workers[i].task);
+        bench_free_worker(&bench.workers[i]);
+    }
+rer1:
+    blkdev_put(bench.bdev, mode);
+    bench.bdev = NULL;
+    return ret;
+}
+
+static int results_show(struct seq_file *m, void *v) {
+    struct bench_stats *sum;
+    u64 duration;
+    int dir;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    bench_stats_sum((u64 *)sum, bench.stats, sizeof(*sum));
+    duration = READ_ONCE(bench.duration);
+
+    seq_printf(m, "duration_ns: %llu\n", duration);
+    seq_printf(m, "errors: %llu\n", sum->errors);
+    for (dir = READ; dir <= WRITE; dir++) {
+        const char *title = dir == READ ? "read" : "write";
+
+        seq_printf(m, "%s ios: %llu iops: %llu bandwidth_bps: %llu\n", title, sum->ios[dir],
+                   duration ? div64_u64(sum->ios[dir] * NSEC_PER_SEC, duration) : 0,
+                   duration ? div64_u64(sum->bytes[dir] * NSEC_PER_SEC, duration) : 0);
+        show_percentiles(m, title, "latency", sum->latency[dir], sum->ios[dir]);
+    }
+
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static struct bench_control control = {
+    .name = "sbd_bench",
+    .max = 3600,
+    .run = bench_run,
+};
+
+static int __init bench_init(void) {
+    bench.stats = alloc_percpu(struct bench_stats);
+    if (!bench.stats) {
+        pr_alert("[sbd_bench] Statistics allocation error!\n");
+        return -ENOMEM;
+    }
+
+    bench_control_init(&control, &results_fops);
+    return 0;
+}
+
+static void __exit bench_exit(void) {
+    bench_control_exit(&control);
+    free_percpu(bench.stats);
+}
+
+module_init(bench_init);
+module_exit(bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Muhammed Yavuz Berk Sener");
+MODULE_DESCRIPTION("An in-kernel load generator for the pseudo block device.");
+MODULE_VERSION("1.0");
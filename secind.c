@@ -1,52 +1,497 @@
 #include <linux/module.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
 
-static struct workqueue_struct *queue;
+#include "bench_hist.h"
+#include "bench_run.h"
 
-static void normal_work_handler(struct work_struct *work)
+#define MAX_PRODUCERS 64
+#define MAX_ITEMS (1ULL << 32)
+// Worker pool samples, one per SAMPLE_MS for the first minute of a run.
+#define SAMPLE_MS 100
+#define MAX_SAMPLES 600
+
+#define MAX_FLAVOUR 64
+
+static char flavour[MAX_FLAVOUR] = "bound";
+module_param_string(flavour, flavour, sizeof(flavour), 0644);
+MODULE_PARM_DESC(flavour, "system, or a comma separated mix of bound, unbound, highpri and cpu_intensive, for runs that do not name one (default: bound)");
+
+static int max_active = 0;
+module_param(max_active, int, 0644);
+MODULE_PARM_DESC(max_active, "max_active of the benchmark workqueue, 0 for the default; must be 0 with the system workqueue (default: 0)");
+
+static int cpus[MAX_PRODUCERS];
+static int nr_cpus = 0;
+module_param_array(cpus, int, &nr_cpus, 0644);
+MODULE_PARM_DESC(cpus, "CPUs to bind producer i to, one producer per entry; one per online CPU if empty");
+
+static bool remote = false;
+module_param(remote, bool, 0644);
+MODULE_PARM_DESC(remote, "Queue to the CPU of the next producer instead of the local one (default: false)");
+
+static unsigned int depth = 1024;
+module_param(depth, uint, 0644);
+MODULE_PARM_DESC(depth, "Work items in flight per producer (default: 1024)");
+
+static unsigned int work_ns = 0;
+module_param(work_ns, uint, 0644);
+MODULE_PARM_DESC(work_ns, "Nanoseconds each work item spins for (default: 0)");
+
+static const struct {
+    const char *name;
+    unsigned int flags;
+} flavours[] = {
+    { "bound", 0 },
+    { "unbound", WQ_UNBOUND },
+    { "highpri", WQ_HIGHPRI },
+    { "cpu_intensive", WQ_CPU_INTENSIVE },
+};
+
+struct bench_stats {
+    u64 items;
+    u64 exec_ns;
+    u64 latency[HIST_BUCKETS];
+};
+
+struct bench_sample {
+    u32 ms;
+    u32 workers;
+    u32 running;
+    u32 backlog;
+};
+
+struct bench_producer;
+
+struct bench_item {
+    struct work_struct work;
+    struct llist_node node;
+    struct bench_producer *producer;
+    u64 queued;
+};
+
+struct bench_producer {
+    struct task_struct *task;
+    struct bench_item *items;
+    struct llist_head free;
+    atomic_t inflight;
+    wait_queue_head_t wait;
+    unsigned long quota;
+    unsigned long queued;
+    int cpu;
+    int target;
+};
+
+// The workqueue only exists for the duration of a run, so every run can
+// use another flavour.
+static struct bench_struct {
+    struct workqueue_struct *wq;
+    char flavour[MAX_FLAVOUR];
+    unsigned int flags;
+    int max_active;
+    struct bench_producer producers[MAX_PRODUCERS];
+    struct bench_stats __percpu *stats;
+    // Kworkers that have run an item in this run, keyed by PID.
+    struct xarray workers;
+    atomic_t nr_workers;
+    atomic_t running;
+    atomic_t max_running;
+    atomic64_t remaining;
+    struct completion done;
+    struct bench_sample samples[MAX_SAMPLES];
+    unsigned int nr_samples;
+    unsigned int nr_producers;
+    unsigned int depth;
+    unsigned int work_ns;
+    bool remote;
+    u64 nr_items;
+    u64 duration;
+} bench;
+
+// A kworker is counted the first time it runs one of our items, which shows
+// how far the pool behind the workqueue grew to keep up.
+static void note_worker(void)
 {
-    pr_info("Hi! I'm handler of normal work!\n");
+    unsigned long pid = task_pid_nr(current);
+
+    if (xa_load(&bench.workers, pid))
+        return;
+    if (!xa_insert(&bench.workers, pid, xa_mk_value(0), GFP_KERNEL))
+        atomic_inc(&bench.nr_workers);
 }
 
-static void delayed_work_handler(struct work_struct *work)
+static void bench_work_handler(struct work_struct *work)
 {
-    pr_info("Hi! I'm handler of delayed work!\n");
+    struct bench_item *item = container_of(work, struct bench_item, work);
+    struct bench_producer *producer = item->producer;
+    struct bench_stats *stats;
+    u64 start = ktime_get_ns();
+    int running, max;
+
+    running = atomic_inc_return(&bench.running);
+    max = atomic_read(&bench.max_running);
+    while (running > max && !atomic_try_cmpxchg(&bench.max_running, &max, running))
+        ;
+    note_worker();
+    while (ktime_get_ns() - start < bench.work_ns)
+        cpu_relax();
+    atomic_dec(&bench.running);
+
+    stats = get_cpu_ptr(bench.stats);
+    stats->items++;
+    stats->exec_ns += ktime_get_ns() - start;
+    stats->latency[hist_bucket(start - item->queued)]++;
+    put_cpu_ptr(bench.stats);
+
+    // The item may be queued again as soon as it is back on the free list.
+    llist_add(&item->node, &producer->free);
+    atomic_dec(&producer->inflight);
+    wake_up(&producer->wait);
+    if (atomic64_dec_and_test(&bench.remaining))
+        complete(&bench.done);
 }
 
-static DECLARE_WORK(normal_work, normal_work_handler);
-static DECLARE_DELAYED_WORK(delayed_work, delayed_work_handler);
+// Keep depth items in flight until the quota is queued, then drain.
+static int bench_producer_thread(void *data)
+{
+    struct bench_producer *producer = data;
+    struct llist_node *local = NULL;
+    struct bench_item *item;
 
-static int __init workqueue_module_init(void)
+    while (producer->queued < producer->quota && !kthread_should_stop())
+    {
+        if (!local)
+            local = llist_del_all(&producer->free);
+        if (!local)
+        {
+            wait_event_timeout(producer->wait, !llist_empty(&producer->free), HZ / 10);
+            continue;
+        }
+        item = llist_entry(local, struct bench_item, node);
+        local = local->next;
+
+        atomic_inc(&producer->inflight);
+        item->queued = ktime_get_ns();
+        if (bench.remote)
+            queue_work_on(producer->target, bench.wq, &item->work);
+        else
+            queue_work(bench.wq, &item->work);
+        WRITE_ONCE(producer->queued, producer->queued + 1);
+        cond_resched();
+    }
+    wait_event(producer->wait, atomic_read(&producer->inflight) == 0);
+    bench_wait_for_stop();
+    return 0;
+}
+
+static void bench_free_producer(struct bench_producer *producer)
 {
-    queue = create_workqueue("works");
-    if (!queue)
+    unsigned int i;
+
+    if (!producer->items)
+        return;
+    // A handler may still be returning after putting its item back.
+    for (i = 0; i < bench.depth; i++)
+        flush_work(&producer->items[i].work);
+    kvfree(producer->items);
+    producer->items = NULL;
+}
+
+static int bench_alloc_producer(struct bench_producer *producer, unsigned int index)
+{
+    struct bench_item *item;
+    unsigned int i;
+    u32 rest;
+
+    producer->quota = div_u64_rem(bench.nr_items, bench.nr_producers, &rest);
+    if (index < rest)
+        producer->quota++;
+    producer->queued = 0;
+    init_llist_head(&producer->free);
+    atomic_set(&producer->inflight, 0);
+    init_waitqueue_head(&producer->wait);
+
+    producer->items = kvcalloc(bench.depth, sizeof(*producer->items), GFP_KERNEL);
+    if (!producer->items)
+        return -ENOMEM;
+    for (i = 0; i < bench.depth; i++)
+    {
+        item = &producer->items[i];
+        INIT_WORK(&item->work, bench_work_handler);
+        item->producer = producer;
+        llist_add(&item->node, &producer->free);
+    }
+
+    producer->task = kthread_create(bench_producer_thread, producer, "wq_bench/%u", index);
+    if (IS_ERR(producer->task))
+    {
+        producer->task = NULL;
+        bench_free_producer(producer);
+        return -ENOMEM;
+    }
+    kthread_bind(producer->task, producer->cpu);
+    return 0;
+}
+
+// Turns the run's flavour into workqueue flags; "system" leaves them alone
+// and means the run uses system_wq.
+static bool parse_flavour(void)
+{
+    char names[MAX_FLAVOUR], *cursor, *name;
+    int i;
+
+    bench.flags = 0;
+    if (!strcmp(bench.flavour, "system"))
+        return true;
+    strscpy(names, bench.flavour, sizeof(names));
+    cursor = names;
+    while ((name = strsep(&cursor, ",")))
+    {
+        for (i = 0; i < ARRAY_SIZE(flavours); i++)
+        {
+            if (!strcmp(name, flavours[i].name))
+                break;
+        }
+        if (i == ARRAY_SIZE(flavours))
+        {
+            pr_alert("[workqueue_module] Unknown flavour %s\n", name);
+            return false;
+        }
+        bench.flags |= flavours[i].flags;
+    }
+    return true;
+}
+
+static bool bench_check_params(void)
+{
+    int i;
+
+    if (!parse_flavour())
+        return false;
+    if (bench.max_active < 0 || bench.max_active > WQ_MAX_ACTIVE)
+    {
+        pr_alert("[workqueue_module] max_active must be between 0 and %d\n", WQ_MAX_ACTIVE);
+        return false;
+    }
+    // Settings that the chosen queue would silently ignore.
+    if (!strcmp(bench.flavour, "system") && bench.max_active)
+    {
+        pr_alert("[workqueue_module] max_active cannot be set on the system workqueue\n");
+        return false;
+    }
+    if ((bench.flags & WQ_UNBOUND) && remote)
+        pr_warn("[workqueue_module] remote only picks the NUMA node on an unbound workqueue\n");
+    if (!depth)
+    {
+        pr_alert("[workqueue_module] depth must not be zero\n");
+        return false;
+    }
+    for (i = 0; i < nr_cpus; i++)
+    {
+        if (cpus[i] < 0 || cpus[i] >= nr_cpu_ids || !cpu_online(cpus[i]))
+        {
+            pr_alert("[workqueue_module] CPU %d is not online\n", cpus[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void take_sample(u64 start)
+{
+    struct bench_sample *sample;
+    u64 executed = 0, queued = 0;
+    unsigned int i;
+    int cpu;
+
+    if (bench.nr_samples == MAX_SAMPLES)
+        return;
+    for_each_possible_cpu(cpu)
+        executed += per_cpu_ptr(bench.stats, cpu)->items;
+    for (i = 0; i < bench.nr_producers; i++)
+        queued += READ_ONCE(bench.producers[i].queued);
+
+    sample = &bench.samples[bench.nr_samples];
+    sample->ms = div_u64(ktime_get_ns() - start, NSEC_PER_MSEC);
+    sample->workers = atomic_read(&bench.nr_workers);
+    sample->running = atomic_read(&bench.running);
+    sample->backlog = queued > executed ? queued - executed : 0;
+    bench.nr_samples++;
+}
+
+// Runs until the number of items written to the start file have been
+// executed, or until the writer is interrupted. A flavour written after the
+// number of items overrides the flavour parameter for this run.
+static int bench_run(u64 nr_items, char *options)
+{
+    unsigned int i;
+    u64 start;
+    long left;
+    int ret = 0, cpu;
+
+    if (strscpy(bench.flavour, *options ? options : flavour, sizeof(bench.flavour)) < 0)
+        return -EINVAL;
+    // A flavour written to the parameter through sysfs keeps its newline.
+    bench.flavour[strcspn(bench.flavour, "\n")] = '\0';
+    bench.max_active = max_active;
+    if (!bench_check_params())
+        return -EINVAL;
+
+    bench.nr_producers = 0;
+    if (nr_cpus)
+    {
+        for (i = 0; i < nr_cpus; i++)
+            bench.producers[bench.nr_producers++].cpu = cpus[i];
+    }
+    else
+    {
+        for_each_online_cpu(cpu)
+        {
+            if (bench.nr_producers == MAX_PRODUCERS)
+                break;
+            bench.producers[bench.nr_producers++].cpu = cpu;
+        }
+    }
+    for (i = 0; i < bench.nr_producers; i++)
+        bench.producers[i].target = bench.producers[(i + 1) % bench.nr_producers].cpu;
+    bench.depth = depth;
+    bench.work_ns = work_ns;
+    bench.remote = remote;
+    bench.nr_items = nr_items;
+    bench.duration = 0;
+    bench.nr_samples = 0;
+    xa_destroy(&bench.workers);
+    atomic_set(&bench.nr_workers, 0);
+    atomic_set(&bench.running, 0);
+    atomic_set(&bench.max_running, 0);
+    atomic64_set(&bench.remaining, nr_items);
+    reinit_completion(&bench.done);
+    bench_stats_reset(bench.stats, sizeof(struct bench_stats));
+
+    if (!strcmp(bench.flavour, "system"))
+        bench.wq = system_wq;
+    else
+        bench.wq = alloc_workqueue("wq_bench", bench.flags, bench.max_active);
+    if (!bench.wq)
     {
         pr_alert("[workqueue_module] Error creating a workqueue\n");
         return -ENOMEM;
     }
 
-    if (schedule_work(&normal_work))
-        pr_info("The normal work was already queued!\n");
-    if (schedule_delayed_work(&delayed_work, 10 * HZ))
-        pr_info("The delayed work was already queued!\n");
+    for (i = 0; i < bench.nr_producers; i++)
+    {
+        ret = bench_alloc_producer(&bench.producers[i], i);
+        if (ret)
+        {
+            pr_alert("[workqueue_module] Error allocating producer %u\n", i);
+            goto rer1;
+        }
+    }
+
+    start = ktime_get_ns();
+    for (i = 0; i < bench.nr_producers; i++)
+        wake_up_process(bench.producers[i].task);
+    do
+    {
+        left = wait_for_completion_interruptible_timeout(&bench.done, msecs_to_jiffies(SAMPLE_MS));
+        take_sample(start);
+    } while (!left);
+    bench.duration = ktime_get_ns() - start;
+    for (i = 0; i < bench.nr_producers; i++)
+        kthread_stop(bench.producers[i].task);
+    pr_info("[workqueue_module] Finished a run of %llu work items on the %s workqueue\n",
+            nr_items, bench.flavour);
+
+    i = bench.nr_producers;
+rer1:
+    while (i--)
+    {
+        if (ret && bench.producers[i].task)
+            kthread_stop(bench.producers[i].task);
+        bench_free_producer(&bench.producers[i]);
+    }
+    if (bench.wq != system_wq)
+        destroy_workqueue(bench.wq);
+    bench.wq = NULL;
+    return ret;
+}
+
+static int results_show(struct seq_file *m, void *v)
+{
+    struct bench_stats *sum;
+    struct bench_sample *sample;
+    unsigned int i;
+    u64 duration;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    bench_stats_sum((u64 *)sum, bench.stats, sizeof(*sum));
+    duration = READ_ONCE(bench.duration);
+
+    seq_printf(m, "flavour: %s max_active: %d producers: %u depth: %u remote: %d work_ns: %u\n",
+               bench.flavour, bench.max_active, bench.nr_producers, bench.depth, bench.remote, bench.work_ns);
+    seq_printf(m, "items: %llu duration_ns: %llu items_per_sec: %llu exec_ns: %llu\n",
+               sum->items, duration,
+               duration ? div64_u64(sum->items * NSEC_PER_SEC, duration) : 0, sum->exec_ns);
+    show_percentiles(m, "queue_to_execute", "latency", sum->latency, sum->items);
+    seq_printf(m, "workers: %d max_running: %d\n", atomic_read(&bench.nr_workers),
+               atomic_read(&bench.max_running));
+    seq_puts(m, "ms workers running backlog\n");
+    for (i = 0; i < READ_ONCE(bench.nr_samples); i++)
+    {
+        sample = &bench.samples[i];
+        seq_printf(m, "%u %u %u %u\n", sample->ms, sample->workers, sample->running, sample->backlog);
+    }
+
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static struct bench_control control = {
+    .name = "wq_bench",
+    .max = MAX_ITEMS,
+    .run = bench_run,
+};
+
+static int __init workqueue_module_init(void)
+{
+    bench.stats = alloc_percpu(struct bench_stats);
+    if (!bench.stats)
+    {
+        pr_alert("[workqueue_module] Statistics allocation error\n");
+        return -ENOMEM;
+    }
+    xa_init(&bench.workers);
+    init_completion(&bench.done);
 
+    bench_control_init(&control, &results_fops);
     return 0;
 }
 
 static void __exit workqueue_module_exit(void)
 {
-    if (cancel_work_sync(&normal_work))
-        pr_info("The normal work has not been done yet!\n");
-    if (cancel_delayed_work_sync(&delayed_work))
-        pr_info("The delayed work has not been done yet!\n");
-
-    flush_scheduled_work();
-    destroy_workqueue(queue);
+    bench_control_exit(&control);
+    xa_destroy(&bench.workers);
+    free_percpu(bench.stats);
 }
 
 module_init(workqueue_module_init);
 module_exit(workqueue_module_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Muhammed Yavuz Berk Sener");
-MODULE_DESCRIPTION("A module demonstrating the use of work queues.");
+MODULE_DESCRIPTION("A module benchmarking the flavours of work queues.");
 MODULE_VERSION("1.0");
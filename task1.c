@@ -1,17 +1,198 @@
 #include <linux/module.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#define JITTER_BUCKETS 64
+// Shortest hrtimer period: a restarting timer that expires every few
+// microseconds keeps its CPU in the timer interrupt.
+#define HR_MIN_PERIOD_NS (50 * NSEC_PER_USEC)
+// Longest period, about 71 minutes: usecs_to_jiffies() takes an unsigned int.
+#define MAX_PERIOD_US UINT_MAX
+
+static char mode[16] = "timer_list";
+module_param_string(mode, mode, sizeof(mode), 0444);
+MODULE_PARM_DESC(mode, "Timer engine: timer_list or hrtimer (default: timer_list)");
+
+static unsigned long period_us = 15 * USEC_PER_SEC;
+module_param(period_us, ulong, 0444);
+MODULE_PARM_DESC(period_us, "Period in microseconds, up to 4294967295 (default: 15000000)");
+
+static bool hr_absolute = true;
+module_param(hr_absolute, bool, 0444);
+MODULE_PARM_DESC(hr_absolute, "Arm the hrtimer with an absolute expiry (default: true)");
+
+static bool hr_pinned = false;
+module_param(hr_pinned, bool, 0444);
+MODULE_PARM_DESC(hr_pinned, "Pin the hrtimer to the CPU that armed it (default: false)");
+
+static bool hr_soft = false;
+module_param(hr_soft, bool, 0444);
+MODULE_PARM_DESC(hr_soft, "Run the hrtimer callback in softirq context (default: false)");
+
+// Expiry lateness per CPU. Bucket b counts lateness in [2^(b - 1), 2^b) ns,
+// bucket 0 expiries that were on time or early.
+struct jitter_stats {
+    u64 hist[JITTER_BUCKETS];
+    u64 expiries;
+    u64 early;
+    u64 overruns;
+    u64 max_ns;
+};
+
+static DEFINE_PER_CPU(struct jitter_stats, jitter_stats);
 
 static struct timer_list timer;
+static struct hrtimer hrtimer;
+static bool use_hrtimer;
+static ktime_t period;
+// When the timer_list timer is due, as precisely as it was asked for.
+static ktime_t deadline;
+static struct dentry *timer_debugfs;
+
+static void record_jitter(ktime_t late)
+{
+    struct jitter_stats *stats = this_cpu_ptr(&jitter_stats);
+    s64 ns = ktime_to_ns(late);
+
+    stats->expiries++;
+    if (ns <= 0) {
+        stats->early++;
+        stats->hist[0]++;
+        return;
+    }
+    stats->hist[min_t(unsigned int, fls64(ns), JITTER_BUCKETS - 1)]++;
+    if (ns > stats->max_ns)
+        stats->max_ns = ns;
+}
 
 static void timer_handler(struct timer_list *timer)
 {
+    record_jitter(ktime_sub(ktime_get(), deadline));
     pr_info("Timer at the address %p is active!\n", timer);
-    mod_timer(timer, jiffies + 15 * HZ);
+    deadline = ktime_add(ktime_get(), period);
+    mod_timer(timer, jiffies + usecs_to_jiffies(period_us));
 }
 
+// Rearming from the previous expiry rather than from now keeps the period
+// from drifting; periods missed entirely are skipped and counted.
+static enum hrtimer_restart hrtimer_handler(struct hrtimer *timer)
+{
+    ktime_t now = hrtimer_cb_get_time(timer);
+    u64 missed;
+
+    record_jitter(ktime_sub(now, hrtimer_get_expires(timer)));
+    missed = hrtimer_forward(timer, now, period);
+    if (missed > 1)
+        this_cpu_add(jitter_stats.overruns, missed - 1);
+
+    return HRTIMER_RESTART;
+}
+
+static void show_hist(struct seq_file *m, const u64 *hist)
+{
+    int b;
+
+    for (b = 0; b < JITTER_BUCKETS; b++) {
+        if (hist[b])
+            seq_printf(m, "  < %llu ns: %llu\n", b ? 1ULL << b : 1ULL, hist[b]);
+    }
+}
+
+static int jitter_show(struct seq_file *m, void *v)
+{
+    struct jitter_stats *sum, *stats;
+    int cpu, b;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    seq_printf(m, "mode: %s\nperiod_us: %lu\n", use_hrtimer ? "hrtimer" : "timer_list", period_us);
+    for_each_possible_cpu(cpu) {
+        stats = per_cpu_ptr(&jitter_stats, cpu);
+        if (!stats->expiries)
+            continue;
+        seq_printf(m, "cpu%d: expiries %llu early %llu overruns %llu max_ns %llu\n", cpu,
+                   stats->expiries, stats->early, stats->overruns, stats->max_ns);
+        show_hist(m, stats->hist);
+        sum->expiries += stats->expiries;
+        sum->early += stats->early;
+        sum->overruns += stats->overruns;
+        sum->max_ns = max(sum->max_ns, stats->max_ns);
+        for (b = 0; b < JITTER_BUCKETS; b++)
+            sum->hist[b] += stats->hist[b];
+    }
+    seq_printf(m, "total: expiries %llu early %llu overruns %llu max_ns %llu\n",
+               sum->expiries, sum->early, sum->overruns, sum->max_ns);
+    show_hist(m, sum->hist);
+
+    kfree(sum);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(jitter);
+
+static ssize_t reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&jitter_stats, cpu), 0, sizeof(struct jitter_stats));
+    return count;
+}
+
+static const struct file_operations reset_fops = {
+    .owner = THIS_MODULE,
+    .write = reset_write,
+    .llseek = noop_llseek,
+};
+
 static int __init timer_module_init(void)
 {
-    timer.expires = jiffies + 15 * HZ;
+    enum hrtimer_mode hr_mode;
+    u64 min_ns;
+
+    if (!strcmp(mode, "hrtimer")) {
+        use_hrtimer = true;
+    } else if (strcmp(mode, "timer_list")) {
+        pr_alert("[timer_module] mode must be timer_list or hrtimer\n");
+        return -EINVAL;
+    }
+    if (!period_us || period_us > MAX_PERIOD_US) {
+        pr_alert("[timer_module] period_us must be between 1 and %u\n", MAX_PERIOD_US);
+        return -EINVAL;
+    }
+    min_ns = max_t(u64, HR_MIN_PERIOD_NS, hrtimer_resolution);
+    if (use_hrtimer && (u64)period_us * NSEC_PER_USEC < min_ns) {
+        pr_alert("[timer_module] period_us must be at least %llu for hrtimer\n",
+                 div_u64(min_ns, NSEC_PER_USEC));
+        return -EINVAL;
+    }
+    period = us_to_ktime(period_us);
+
+    timer_debugfs = debugfs_create_dir("timer_module", NULL);
+    debugfs_create_file("jitter", 0444, timer_debugfs, NULL, &jitter_fops);
+    debugfs_create_file("reset", 0200, timer_debugfs, NULL, &reset_fops);
+
+    if (use_hrtimer) {
+        hr_mode = hr_absolute ? HRTIMER_MODE_ABS : HRTIMER_MODE_REL;
+        if (hr_pinned)
+            hr_mode |= HRTIMER_MODE_PINNED;
+        if (hr_soft)
+            hr_mode |= HRTIMER_MODE_SOFT;
+        hrtimer_init(&hrtimer, CLOCK_MONOTONIC, hr_mode);
+        hrtimer.function = hrtimer_handler;
+        hrtimer_start(&hrtimer, hr_absolute ? ktime_add(ktime_get(), period) : period, hr_mode);
+        return 0;
+    }
+
+    timer.expires = jiffies + usecs_to_jiffies(period_us);
+    deadline = ktime_add(ktime_get(), period);
     timer_setup(&timer, timer_handler, 0);
     add_timer(&timer);
     return 0;
@@ -19,13 +200,16 @@ static int __init timer_module_init(void)
 
 static void __exit timer_module_exit(void)
 {
-    if (del_timer_sync(&timer))
+    if (use_hrtimer)
+        hrtimer_cancel(&hrtimer);
+    else if (del_timer_sync(&timer))
         pr_notice("The timer was not active!\n");
+    debugfs_remove_recursive(timer_debugfs);
 }
 
 module_init(timer_module_init);
 module_exit(timer_module_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Muhammed Yavuz Berk Sener");
-MODULE_DESCRIPTION("A module demonstrating the usage of low resolution timers.");
+MODULE_DESCRIPTION("A module demonstrating the usage of low and high resolution timers.");
 MODULE_VERSION("1.0");
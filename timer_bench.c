@@ -0,0 +1,511 @@
+#include <linux/module.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/kernel_stat.h>
+#include <linux/interrupt.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/prandom.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#include "bench_hist.h"
+#include "bench_run.h"
+
+#define MAX_WORKERS 64
+#define MAX_TIMERS (16 << 20)
+// Keeps the elapsed nanoseconds of an hour long run times the rate in a u64.
+#define MAX_REARM_RATE 1000000
+
+enum bench_engine {
+    ENGINE_TIMER_LIST,
+    ENGINE_HRTIMER,
+    NR_ENGINES,
+};
+
+static const char *const engine_names[] = { "timer_list", "hrtimer", "both" };
+
+enum bench_op {
+    OP_ADD,
+    OP_MOD,
+    OP_DEL,
+    NR_OPS,
+};
+
+static const char *const op_names[NR_OPS] = { "add", "mod", "del" };
+
+static char engine[16] = "both";
+module_param_string(engine, engine, sizeof(engine), 0644);
+MODULE_PARM_DESC(engine, "Timers to load: timer_list, hrtimer or both, one after the other (default: both)");
+
+static unsigned int nr_timers = 100000;
+module_param(nr_timers, uint, 0644);
+MODULE_PARM_DESC(nr_timers, "Number of timers kept armed (default: 100000)");
+
+static int cpus[MAX_WORKERS];
+static int nr_cpus = 0;
+module_param_array(cpus, int, &nr_cpus, 0644);
+MODULE_PARM_DESC(cpus, "CPUs to arm the timers on, one worker per entry, repeat a CPU to weight it; all online CPUs if empty");
+
+static unsigned int expiry_min_ms = 100;
+module_param(expiry_min_ms, uint, 0644);
+MODULE_PARM_DESC(expiry_min_ms, "Shortest timeout in milliseconds (default: 100)");
+
+static unsigned int expiry_spread_ms = 10000;
+module_param(expiry_spread_ms, uint, 0644);
+MODULE_PARM_DESC(expiry_spread_ms, "Timeouts are spread uniformly over this many milliseconds above the minimum (default: 10000)");
+
+static unsigned int rearm_rate = 10000;
+module_param(rearm_rate, uint, 0644);
+MODULE_PARM_DESC(rearm_rate, "Pending timers pushed back per second per worker, 0 for none (default: 10000)");
+
+static unsigned int rearm_percent = 50;
+module_param(rearm_percent, uint, 0644);
+MODULE_PARM_DESC(rearm_percent, "Share of expired timers that rearm themselves in percent (default: 50)");
+
+// Every field is a u64 counter so that the per-CPU copies can be summed as
+// an array. Op costs are written from the workers, the rest from callbacks.
+struct bench_stats {
+    u64 ops[NR_OPS];
+    u64 op_ns[NR_OPS];
+    u64 expiries;
+    u64 early;
+    u64 rearms;
+    u64 callback_ns;
+    u64 op_hist[NR_OPS][HIST_BUCKETS];
+    u64 lateness[HIST_BUCKETS];
+};
+
+struct bench_result {
+    struct bench_stats stats;
+    u64 duration;
+    // Deltas of the kernel's CPU time accounting over the worker CPUs. The
+    // times are only exact with CONFIG_IRQ_TIME_ACCOUNTING, otherwise they
+    // are sampled at the tick.
+    u64 softirq_ns;
+    u64 irq_ns;
+    u64 timer_softirqs;
+    u64 hrtimer_softirqs;
+    unsigned int nr_timers;
+    unsigned int nr_workers;
+    bool valid;
+};
+
+struct bench_timer {
+    union {
+        struct timer_list timer;
+        struct hrtimer hrtimer;
+    };
+    // When the timer_list timer was asked to expire, to the nanosecond.
+    u64 deadline;
+};
+
+struct bench_worker {
+    struct task_struct *task;
+    unsigned int index;
+    unsigned int armed;
+    int cpu;
+};
+
+static struct bench_struct {
+    struct bench_timer *timers;
+    struct bench_worker workers[MAX_WORKERS];
+    struct bench_stats __percpu *stats;
+    struct bench_result results[NR_ENGINES];
+    struct cpumask cpus;
+    enum bench_engine engine;
+    unsigned int nr_workers;
+    unsigned int nr_timers;
+    unsigned int rearm_rate;
+    unsigned int rearm_percent;
+    u32 spread_us;
+    u64 min_ns;
+    unsigned long deadline;
+    bool stopping;
+} bench;
+
+static inline u64 bench_delay_ns(void) {
+    return bench.min_ns + (u64)prandom_u32_max(bench.spread_us + 1) * NSEC_PER_USEC;
+}
+
+static inline struct bench_timer *bench_own_timer(struct bench_worker *worker, unsigned int k) {
+    return &bench.timers[worker->index + k * bench.nr_workers];
+}
+
+static void bench_record_op(enum bench_op op, u64 ns) {
+    struct bench_stats *stats = get_cpu_ptr(bench.stats);
+
+    stats->ops[op]++;
+    stats->op_ns[op] += ns;
+    stats->op_hist[op][hist_bucket(ns)]++;
+    put_cpu_ptr(bench.stats);
+}
+
+static void bench_record_expiry(struct bench_stats *stats, s64 late) {
+    stats->expiries++;
+    if (late <= 0) {
+        stats->early++;
+        late = 0;
+    }
+    stats->lateness[hist_bucket(late)]++;
+}
+
+static void bench_timer_fn(struct timer_list *timer) {
+    struct bench_timer *t = from_timer(t, timer, timer);
+    struct bench_stats *stats = this_cpu_ptr(bench.stats);
+    u64 now = ktime_get_ns(), delay;
+
+    bench_record_expiry(stats, now - READ_ONCE(t->deadline));
+    if (!READ_ONCE(bench.stopping) && prandom_u32_max(100) < bench.rearm_percent) {
+        delay = bench_delay_ns();
+        WRITE_ONCE(t->deadline, now + delay);
+        mod_timer(timer, jiffies + nsecs_to_jiffies(delay) + 1);
+        stats->rearms++;
+    }
+    stats->callback_ns += ktime_get_ns() - now;
+}
+
+static enum hrtimer_restart bench_hrtimer_fn(struct hrtimer *hrtimer) {
+    struct bench_stats *stats = this_cpu_ptr(bench.stats);
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    ktime_t now = ktime_get();
+
+    bench_record_expiry(stats, ktime_to_ns(ktime_sub(now, hrtimer_get_expires(hrtimer))));
+    if (!READ_ONCE(bench.stopping) && prandom_u32_max(100) < bench.rearm_percent) {
+        hrtimer_set_expires(hrtimer, ktime_add_ns(now, bench_delay_ns()));
+        stats->rearms++;
+        ret = HRTIMER_RESTART;
+    }
+    stats->callback_ns += ktime_get_ns() - ktime_to_ns(now);
+    return ret;
+}
+
+// Only the timer call itself is timed. Both engines queue pinned timers, so
+// a timer always fires on the CPU of the worker that owns it.
+static void bench_arm(struct bench_timer *t, enum bench_op op) {
+    u64 delay = bench_delay_ns(), start, ns;
+
+    if (bench.engine == ENGINE_HRTIMER) {
+        start = ktime_get_ns();
+        hrtimer_start(&t->hrtimer, ns_to_ktime(delay), HRTIMER_MODE_REL_PINNED);
+        ns = ktime_get_ns() - start;
+    } else {
+        // Keeps the callback from running between the deadline and the
+        // timer being updated, since it runs in softirq context on this CPU.
+        // Rounding up by a jiffy keeps the timer from firing before the
+        // deadline.
+        local_bh_disable();
+        WRITE_ONCE(t->deadline, ktime_get_ns() + delay);
+        start = ktime_get_ns();
+        if (op == OP_ADD) {
+            t->timer.expires = jiffies + nsecs_to_jiffies(delay) + 1;
+            add_timer(&t->timer);
+        } else {
+            mod_timer(&t->timer, jiffies + nsecs_to_jiffies(delay) + 1);
+        }
+        ns = ktime_get_ns() - start;
+        local_bh_enable();
+    }
+    bench_record_op(op, ns);
+}
+
+static void bench_cancel(struct bench_timer *t) {
+    u64 start = ktime_get_ns();
+
+    if (bench.engine == ENGINE_HRTIMER)
+        hrtimer_cancel(&t->hrtimer);
+    else
+        del_timer_sync(&t->timer);
+    bench_record_op(OP_DEL, ktime_get_ns() - start);
+}
+
+// Arm the worker's share of the timers, push random ones back at
+// rearm_rate until the deadline, then cancel them all.
+static int bench_thread(void *data) {
+    struct bench_worker *worker = data;
+    struct bench_timer *t;
+    unsigned int k, owned;
+    u64 start, done = 0;
+
+    owned = 0;
+    if (worker->index < bench.nr_timers)
+        owned = DIV_ROUND_UP(bench.nr_timers - worker->index, bench.nr_workers);
+    for (k = 0; k < owned && !kthread_should_stop(); k++) {
+        t = bench_own_timer(worker, k);
+        if (bench.engine == ENGINE_HRTIMER) {
+            hrtimer_init(&t->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+            t->hrtimer.function = bench_hrtimer_fn;
+        } else {
+            timer_setup(&t->timer, bench_timer_fn, TIMER_PINNED);
+        }
+        bench_arm(t, OP_ADD);
+        worker->armed++;
+        cond_resched();
+    }
+
+    start = ktime_get_ns();
+    while (!kthread_should_stop() && time_before(jiffies, bench.deadline)) {
+        if (!worker->armed || !bench.rearm_rate) {
+            msleep_interruptible(10);
+            continue;
+        }
+        if (done >= div_u64((ktime_get_ns() - start) * bench.rearm_rate, NSEC_PER_SEC)) {
+            usleep_range(100, 200);
+            continue;
+        }
+        bench_arm(bench_own_timer(worker, prandom_u32_max(worker->armed)), OP_MOD);
+        done++;
+        cond_resched();
+    }
+
+    WRITE_ONCE(bench.stopping, true);
+    for (k = 0; k < worker->armed; k++) {
+        bench_cancel(bench_own_timer(worker, k));
+        cond_resched();
+    }
+
+    bench_wait_for_stop();
+    return 0;
+}
+
+static void bench_cpu_time(struct bench_result *result, bool end) {
+    u64 softirq_ns = 0, irq_ns = 0, timer_softirqs = 0, hrtimer_softirqs = 0;
+    int cpu;
+
+    for_each_cpu(cpu, &bench.cpus) {
+        softirq_ns += kcpustat_cpu(cpu).cpustat[CPUTIME_SOFTIRQ];
+        irq_ns += kcpustat_cpu(cpu).cpustat[CPUTIME_IRQ];
+        timer_softirqs += kstat_softirqs_cpu(TIMER_SOFTIRQ, cpu);
+        hrtimer_softirqs += kstat_softirqs_cpu(HRTIMER_SOFTIRQ, cpu);
+    }
+    if (end) {
+        result->softirq_ns = softirq_ns - result->softirq_ns;
+        result->irq_ns = irq_ns - result->irq_ns;
+        result->timer_softirqs = timer_softirqs - result->timer_softirqs;
+        result->hrtimer_softirqs = hrtimer_softirqs - result->hrtimer_softirqs;
+    } else {
+        result->softirq_ns = softirq_ns;
+        result->irq_ns = irq_ns;
+        result->timer_softirqs = timer_softirqs;
+        result->hrtimer_softirqs = hrtimer_softirqs;
+    }
+}
+
+static bool bench_check_params(int *engines) {
+    int i, ret;
+
+    ret = match_string(engine_names, ARRAY_SIZE(engine_names), engine);
+    if (ret < 0) {
+        pr_alert("[timer_bench] engine must be timer_list, hrtimer or both!\n");
+        return false;
+    }
+    *engines = ret == NR_ENGINES ? BIT(ENGINE_TIMER_LIST) | BIT(ENGINE_HRTIMER) : BIT(ret);
+    if (!nr_timers || nr_timers > MAX_TIMERS) {
+        pr_alert("[timer_bench] nr_timers must be between 1 and %d!\n", MAX_TIMERS);
+        return false;
+    }
+    if (expiry_spread_ms > 3600 * MSEC_PER_SEC) {
+        pr_alert("[timer_bench] expiry_spread_ms must not exceed an hour!\n");
+        return false;
+    }
+    if (rearm_rate > MAX_REARM_RATE) {
+        pr_alert("[timer_bench] rearm_rate must not exceed %d!\n", MAX_REARM_RATE);
+        return false;
+    }
+    if (rearm_percent > 100) {
+        pr_alert("[timer_bench] rearm_percent must not exceed 100!\n");
+        return false;
+    }
+    for (i = 0; i < nr_cpus; i++) {
+        if (cpus[i] < 0 || cpus[i] >= nr_cpu_ids || !cpu_online(cpus[i])) {
+            pr_alert("[timer_bench] CPU %d is not online!\n", cpus[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int bench_run_engine(enum bench_engine e, unsigned int seconds) {
+    struct bench_result *result = &bench.results[e];
+    struct bench_worker *worker;
+    unsigned int i;
+    u64 start;
+    int ret = 0;
+
+    bench.engine = e;
+    WRITE_ONCE(bench.stopping, false);
+    bench_stats_reset(bench.stats, sizeof(struct bench_stats));
+
+    for (i = 0; i < bench.nr_workers; i++) {
+        worker = &bench.workers[i];
+        worker->armed = 0;
+        worker->task = kthread_create(bench_thread, worker, "timer_bench/%u", i);
+        if (IS_ERR(worker->task)) {
+            pr_alert("[timer_bench] Cannot create worker %u!\n", i);
+            ret = PTR_ERR(worker->task);
+            goto eer1;
+        }
+        kthread_bind(worker->task, worker->cpu);
+    }
+
+    bench_cpu_time(result, false);
+    bench.deadline = jiffies + seconds * HZ;
+    start = ktime_get_ns();
+    for (i = 0; i < bench.nr_workers; i++)
+        wake_up_process(bench.workers[i].task);
+    msleep_interruptible(seconds * MSEC_PER_SEC);
+    for (i = 0; i < bench.nr_workers; i++)
+        kthread_stop(bench.workers[i].task);
+    result->duration = ktime_get_ns() - start;
+    bench_cpu_time(result, true);
+
+    bench_stats_sum((u64 *)&result->stats, bench.stats, sizeof(result->stats));
+    result->nr_timers = bench.nr_timers;
+    result->nr_workers = bench.nr_workers;
+    result->valid = true;
+    pr_info("[timer_bench] Finished a %u second %s run with %u timers.\n", seconds,
+            engine_names[e], bench.nr_timers);
+    return 0;
+
+eer1:
+    // Workers that were never woken up exit without touching their timers.
+    while (i--)
+        kthread_stop(bench.workers[i].task);
+    return ret;
+}
+
+// Runs each engine for the number of seconds written to the start file.
+static int bench_run(u64 seconds, char *options) {
+    int engines, ret = 0, cpu;
+    unsigned int i;
+
+    if (*options || !bench_check_params(&engines))
+        return -EINVAL;
+
+    cpumask_clear(&bench.cpus);
+    bench.nr_workers = 0;
+    if (nr_cpus) {
+        for (i = 0; i < nr_cpus; i++)
+            bench.workers[bench.nr_workers++].cpu = cpus[i];
+    } else {
+        for_each_online_cpu(cpu) {
+            if (bench.nr_workers == MAX_WORKERS)
+                break;
+            bench.workers[bench.nr_workers++].cpu = cpu;
+        }
+    }
+    for (i = 0; i < bench.nr_workers; i++) {
+        bench.workers[i].index = i;
+        cpumask_set_cpu(bench.workers[i].cpu, &bench.cpus);
+    }
+    bench.nr_timers = nr_timers;
+    bench.min_ns = (u64)expiry_min_ms * NSEC_PER_MSEC;
+    bench.spread_us = expiry_spread_ms * USEC_PER_MSEC;
+    bench.rearm_rate = rearm_rate;
+    bench.rearm_percent = rearm_percent;
+
+    bench.timers = kvcalloc(bench.nr_timers, sizeof(*bench.timers), GFP_KERNEL);
+    if (!bench.timers) {
+        pr_alert("[timer_bench] Timer allocation error!\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < NR_ENGINES; i++)
+        bench.results[i].valid = false;
+    for (i = 0; i < NR_ENGINES && !ret; i++) {
+        if (engines & BIT(i))
+            ret = bench_run_engine(i, seconds);
+    }
+
+    kvfree(bench.timers);
+    bench.timers = NULL;
+    return ret;
+}
+
+static inline u64 op_average(const struct bench_stats *stats, enum bench_op op) {
+    return stats->ops[op] ? div64_u64(stats->op_ns[op], stats->ops[op]) : 0;
+}
+
+static inline u64 percent(u64 value, u64 base) {
+    return base ? div64_u64(value * 100, base) : 0;
+}
+
+static int results_show(struct seq_file *m, void *v) {
+    const struct bench_result *tl = &bench.results[ENGINE_TIMER_LIST];
+    const struct bench_result *hr = &bench.results[ENGINE_HRTIMER];
+    const struct bench_result *result;
+    const struct bench_stats *stats;
+    const char *name;
+    int e, op;
+
+    // Results are only filled in once an engine's run has ended.
+    for (e = 0; e < NR_ENGINES; e++) {
+        result = &bench.results[e];
+        if (!result->valid)
+            continue;
+        stats = &result->stats;
+        name = engine_names[e];
+
+        seq_printf(m, "%s duration_ns: %llu timers: %u workers: %u\n", name,
+                   result->duration, result->nr_timers, result->nr_workers);
+        seq_printf(m, "%s expiries: %llu early: %llu rearms: %llu callback_ns: %llu\n", name,
+                   stats->expiries, stats->early, stats->rearms, stats->callback_ns);
+        seq_printf(m, "%s softirq_ns: %llu irq_ns: %llu timer_softirqs: %llu hrtimer_softirqs: %llu\n",
+                   name, result->softirq_ns, result->irq_ns, result->timer_softirqs,
+                   result->hrtimer_softirqs);
+        for (op = 0; op < NR_OPS; op++) {
+            seq_printf(m, "%s %s ops: %llu avg_ns: %llu\n", name, op_names[op], stats->ops[op],
+                       op_average(stats, op));
+            show_percentiles(m, name, op_names[op], stats->op_hist[op], stats->ops[op]);
+        }
+        show_percentiles(m, name, "lateness", stats->lateness, stats->expiries);
+    }
+
+    if (!tl->valid || !hr->valid)
+        return 0;
+    seq_puts(m, "hrtimer/timer_list percent:");
+    for (op = 0; op < NR_OPS; op++)
+        seq_printf(m, " %s %llu", op_names[op],
+                   percent(op_average(&hr->stats, op), op_average(&tl->stats, op)));
+    seq_printf(m, " lateness_p99 %llu interrupt_time %llu\n",
+               percent(hist_percentile(hr->stats.lateness, hr->stats.expiries, 990),
+                       hist_percentile(tl->stats.lateness, tl->stats.expiries, 990)),
+               percent(hr->softirq_ns + hr->irq_ns, tl->softirq_ns + tl->irq_ns));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(results);
+
+static struct bench_control control = {
+    .name = "timer_bench",
+    .max = 3600,
+    .run = bench_run,
+};
+
+static int __init bench_init(void) {
+    bench.stats = alloc_percpu(struct bench_stats);
+    if (!bench.stats) {
+        pr_alert("[timer_bench] Statistics allocation error!\n");
+        return -ENOMEM;
+    }
+
+    bench_control_init(&control, &results_fops);
+    return 0;
+}
+
+static void __exit bench_exit(void) {
+    bench_control_exit(&control);
+    free_percpu(bench.stats);
+}
+
+module_init(bench_init);
+module_exit(bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Muhammed Yavuz Berk Sener");
+MODULE_DESCRIPTION("A module benchmarking timer_list and hrtimer scalability.");
+MODULE_VERSION("1.0");